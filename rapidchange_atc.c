@@ -21,7 +21,9 @@
 */
 
 #include <string.h>
+#include <stdlib.h>
 #include <stdio.h>
+#include <stdarg.h>
 
 #include "grbl/hal.h"
 #include "grbl/motion_control.h"
@@ -31,26 +33,137 @@
 
 #include "rapidchange_atc.h"
 
-// Used to print debug statements in the normal stream
-#define RAPIDCHANGE_DEBUG 1
+#define RAPIDCHANGE_LEVEL_ERROR   1
+#define RAPIDCHANGE_LEVEL_WARNING 2
+#define RAPIDCHANGE_LEVEL_INFO    3
+#define RAPIDCHANGE_LEVEL_DEBUG   4
 
-#if RAPIDCHANGE_DEBUG
-#define RAPIDCHANGE_DEBUG_PRINT(message) \
-    hal.stream.write("[R-ATC]: "); \
-    hal.stream.write(message); \
-    hal.stream.write(ASCII_EOL)
+// Highest level of log messages printed in the normal stream, 0 removes all logging from the build.
+// The active level is selected by setting 961.
+#ifndef RAPIDCHANGE_DEBUG
+#define RAPIDCHANGE_DEBUG 0
+#endif
+
+// Number of log messages queued till printed by the foreground task, must be a power of 2
+#ifndef RAPIDCHANGE_LOG_QUEUE_SIZE
+#define RAPIDCHANGE_LOG_QUEUE_SIZE 8
+#endif
+#define RAPIDCHANGE_LOG_LENGTH 56
+
+// Number of IR sensor edges latched during a tool recognition move
+#ifndef RAPIDCHANGE_RECOGNITION_EDGES
+#define RAPIDCHANGE_RECOGNITION_EDGES 8
+#endif
+
+// Number of magazines, the pockets of all magazines are numbered consecutively starting with magazine 1
+#ifndef RAPIDCHANGE_MAGAZINES
+#define RAPIDCHANGE_MAGAZINES 2
+#endif
+#if RAPIDCHANGE_MAGAZINES < 1 || RAPIDCHANGE_MAGAZINES > 3
+#error "RapidChange supports 1 to 3 magazines"
+#endif
+
+// Number of pockets of all magazines kept in the pocket table, pockets above are not used
+#ifndef RAPIDCHANGE_MAX_POCKETS
+#define RAPIDCHANGE_MAX_POCKETS 32
+#endif
+#if RAPIDCHANGE_MAX_POCKETS > 254
+#error "RapidChange supports up to 254 pockets"
+#endif
+#define RAPIDCHANGE_NO_POCKET 0xFF
+
+// Highest tool number which can be assigned to a pocket, the last probed tool length is kept per tool
+#ifndef RAPIDCHANGE_MAX_TOOLS
+#define RAPIDCHANGE_MAX_TOOLS 32
+#endif
+
+// Number of steps of the compiled tool change sequence
+#ifndef RAPIDCHANGE_MAX_STEPS
+#define RAPIDCHANGE_MAX_STEPS 96
+#endif
+
+// Max number of fine touches of a tool length measurement
+#define RAPIDCHANGE_MAX_TOUCHES 9
+// Number of tool length measurements till a measurement not agreeing fails the tool change
+#ifndef RAPIDCHANGE_PROBE_ATTEMPTS
+#define RAPIDCHANGE_PROBE_ATTEMPTS 3
+#endif
+// Length in mm of the moves the engage with seat detection is queued in
+#ifndef RAPIDCHANGE_ENGAGE_SEGMENT
+#define RAPIDCHANGE_ENGAGE_SEGMENT 1.0f
+#endif
+
+// Timeout in ms of the wait for the spindle speed feedback, the ramp wait times are used without feedback only
+#ifndef RAPIDCHANGE_SPINDLE_TIMEOUT
+#define RAPIDCHANGE_SPINDLE_TIMEOUT 10000
+#endif
+
+// Number of tool changes of a job planned by $RCPLAN
+#ifndef RAPIDCHANGE_PLAN_CHANGES
+#define RAPIDCHANGE_PLAN_CHANGES 32
+#endif
+
+// Number of auto tune levels from the engage settings to the auto tune limits
+#ifndef RAPIDCHANGE_TUNE_LEVELS
+#define RAPIDCHANGE_TUNE_LEVELS 10
+#endif
+// Number of engages at a level meeting the success rate till the next faster level is tried
+#ifndef RAPIDCHANGE_TUNE_WINDOW
+#define RAPIDCHANGE_TUNE_WINDOW 10
+#endif
+// Number of levels to slow down when the success rate is missed
+#define RAPIDCHANGE_TUNE_BACKOFF 2
+
+// Version of the stored settings layout, to be increased when settings are removed or reordered.
+// Settings appended to atc_settings_t keep the version and start with their defaults after an upgrade.
+// The magazine count is stored with the version since the magazine settings are in front of the others.
+#define RAPIDCHANGE_SETTINGS_VERSION 2
+
+// NVS space reserved for the settings, so appended settings do not move the blocks stored after them
+#ifndef RAPIDCHANGE_SETTINGS_RESERVE
+#define RAPIDCHANGE_SETTINGS_RESERVE 384
+#endif
+
+// Number of tool changes kept for the timing statistics
+#ifndef RAPIDCHANGE_TIMING_HISTORY
+#define RAPIDCHANGE_TIMING_HISTORY 8
+#endif
+
+// Configuration values in the setting descriptions
+#define RAPIDCHANGE_STR(x) #x
+#define RAPIDCHANGE_XSTR(x) RAPIDCHANGE_STR(x)
+
+#if RAPIDCHANGE_DEBUG >= RAPIDCHANGE_LEVEL_ERROR
+#define RAPIDCHANGE_LOG_ERROR(...) log_message(RAPIDCHANGE_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define RAPIDCHANGE_LOG_ERROR(...)
+#endif
+#if RAPIDCHANGE_DEBUG >= RAPIDCHANGE_LEVEL_WARNING
+#define RAPIDCHANGE_LOG_WARNING(...) log_message(RAPIDCHANGE_LEVEL_WARNING, __VA_ARGS__)
+#else
+#define RAPIDCHANGE_LOG_WARNING(...)
+#endif
+#if RAPIDCHANGE_DEBUG >= RAPIDCHANGE_LEVEL_INFO
+#define RAPIDCHANGE_LOG_INFO(...) log_message(RAPIDCHANGE_LEVEL_INFO, __VA_ARGS__)
+#else
+#define RAPIDCHANGE_LOG_INFO(...)
+#endif
+#if RAPIDCHANGE_DEBUG >= RAPIDCHANGE_LEVEL_DEBUG
+#define RAPIDCHANGE_LOG_DEBUG(...) log_message(RAPIDCHANGE_LEVEL_DEBUG, __VA_ARGS__)
 #else
-#define RAPIDCHANGE_DEBUG_PRINT(...)
+#define RAPIDCHANGE_LOG_DEBUG(...)
 #endif
 
 static const char *atc_port_names[] = {
     "RapidChange Tool Recognition",
-    "RapidChange Dust Cover"
+    "RapidChange Dust Cover",
+    "RapidChange Dust Cover Feedback"
 };
 
 typedef struct {
     uint8_t tool_recognition;
     uint8_t dust_cover;
+    uint8_t dust_cover_feedback;
 } atc_ports_t;
 
 typedef enum {
@@ -66,6 +179,19 @@ typedef struct {
     float    pocket_offset;
     float    x_pocket_1;
     float    y_pocket_1;
+    uint16_t first_tool;
+} atc_magazine_t;
+
+// Axis along which the spindle moves into the pockets of a magazine, kept apart from the magazine layout
+// so the layout of the stored settings is extended only.
+typedef struct {
+    uint8_t axis;
+    char    direction;
+    float   z_pocket_1;
+} atc_load_axis_t;
+
+typedef struct {
+    atc_magazine_t magazine[RAPIDCHANGE_MAGAZINES];
     float    z_start;
     float    z_retract;
     float    z_engage;
@@ -92,14 +218,437 @@ typedef struct {
     float    dust_cover_axis_open;
     float    dust_cover_axis_close;
     uint8_t  dust_cover_port;
+    bool     planned_sequence;
+    uint16_t spindle_ramp_down_time;
+    bool     spindle_feedback;
+    bool     direct_traverse;
+    uint8_t  log_level;
+    bool     tool_recognition_on_the_fly;
+    float    tool_recognition_debounce;
+    bool     tool_setter_fast_reprobe;
+    float    tool_setter_reprobe_clearance;
+    bool     tlo_cache;
+    uint16_t tlo_cache_max_age;
+    uint8_t  tlo_cache_max_uses;
+    uint16_t dust_cover_port_delay;
+    bool     dust_cover_feedback;
+    uint8_t  dust_cover_feedback_port;
+    bool     dynamic_pockets;
+    bool     engage_tune;
+    float    tune_max_feed_rate;
+    float    tune_max_rpm;
+    uint8_t  tune_success_rate;
+    uint8_t  unload_retries;
+    bool     spindle_traverse;
+    uint16_t spindle_reversal_time;
+    atc_load_axis_t load[RAPIDCHANGE_MAGAZINES];
+    bool     occupancy_check;
+    uint8_t  tool_setter_touches;
+    float    tool_setter_touch_retract;
+    float    tool_setter_touch_tolerance;
+    float    tool_setter_cache_tolerance;
+    bool     park;
+    float    park_x;
+    float    park_y;
+    float    park_z;
+    bool     seat_detection;
+    uint8_t  seat_rpm_drop;
+    float    seat_window;
 } atc_settings_t;
 
-static nvs_address_t nvs_address;
+typedef struct {
+    int32_t position;
+    bool    state;
+} atc_recognition_edge_t;
+
+// IR beam changes latched while moving along the load axis.
+typedef struct {
+    uint8_t                axis;
+    bool                   initial_state;
+    int32_t                start;
+    volatile uint_fast8_t  n_edges;
+    volatile bool          overflow;
+    atc_recognition_edge_t edge[RAPIDCHANGE_RECOGNITION_EDGES];
+} atc_recognition_t;
+
+typedef struct {
+    int32_t  probe_z;
+    uint16_t measured_at;
+    uint8_t  uses;
+    bool     valid;
+} atc_tlo_cache_t;
+
+// Stored tool lengths indexed by tool number, a length belongs to the tool holder and
+// stays valid when the dynamic pocket map moves the tool to another pocket.
+typedef struct {
+    uint16_t        changes;
+    atc_tlo_cache_t tool[RAPIDCHANGE_MAX_TOOLS];
+} atc_tlo_cache_block_t;
+
+typedef enum {
+    SetTool_None = 0,
+    SetTool_StoredOffset,
+    SetTool_Reprobe,
+    SetTool_Probe
+} atc_set_tool_mode_t;
+
+typedef struct {
+    float x;
+    float y;
+    float z;
+} atc_pocket_correction_t;
+
+// Tools held by the pockets if the pockets are assigned dynamically, 0 is an empty pocket.
+// Initialized from the magazine layout if the number of pockets changes.
+typedef struct {
+    uint8_t   n_pockets;
+    tool_id_t tool[RAPIDCHANGE_MAX_POCKETS];
+} atc_pocket_map_t;
+
+// Pocket occupancy by pocket bit, known from the tool changes or set by $RCOCCUPY.
+// Reset if the number of pockets changes.
+typedef struct {
+    uint8_t n_pockets;
+    uint8_t known[(RAPIDCHANGE_MAX_POCKETS + 7) / 8];
+    uint8_t occupied[(RAPIDCHANGE_MAX_POCKETS + 7) / 8];
+} atc_occupancy_t;
+
+// Pockets holding the same tool are linked by next, starting with the pocket in tool_pocket.
+typedef struct {
+    coord_data_t position;
+    tool_id_t    tool_id;
+    uint8_t      magazine;
+    uint8_t      next;
+} atc_pocket_t;
+
+typedef struct {
+    tool_id_t    tool_id;
+    bool         has_pocket;
+    uint8_t      pocket;
+    coord_data_t position;
+} atc_pocket_plan_t;
+
+typedef struct {
+    bool                valid;
+    atc_pocket_plan_t   unload;
+    atc_pocket_plan_t   load;
+    bool                same_magazine;
+    bool                traverse_via;
+    coord_data_t        via;
+    atc_set_tool_mode_t set_tool;
+    float               probe_start;
+} atc_change_plan_t;
+
+typedef enum {
+    Engage_Load = 0,
+    Engage_Unload,
+    Engage_Count
+} atc_engage_t;
+
+// Auto tune state of an engage, the feed rate and spindle speed are interpolated by the level.
+typedef struct {
+    uint8_t  level;         // 0: settings 920 - 922, RAPIDCHANGE_TUNE_LEVELS: auto tune limits
+    uint8_t  samples;       // engages since the level was changed
+    uint8_t  successes;     // successful engages since the level was changed
+    uint16_t engages;
+    uint16_t failures;
+} atc_tune_t;
+
+typedef enum {
+    Phase_RecordState = 0,
+    Phase_DustCoverOpen,
+    Phase_Unload,
+    Phase_Load,
+    Phase_SetTool,
+    Phase_DustCoverClose,
+    Phase_RestoreState,
+    Phase_Idle
+} atc_phase_t;
+
+typedef struct {
+    uint32_t duration[Phase_Idle];
+    uint16_t barriers[Phase_Idle];
+} atc_phase_times_t;
+
+typedef enum {
+    Step_End = 0,
+    Step_Phase,             // arg: phase
+    Step_Rapid,             // arg: reference, value: position
+    Step_Feed,              // arg: reference, value: position, moves at the engage feed rate
+    Step_Engage,            // arg: reference, value: position, moves at the engage feed rate till the nut seats
+    Step_RapidPocket,       // arg: reference of the pocket, moves to the pocket on all axes but the load axis
+    Step_PocketToPocket,    // moves from the unload pocket to the start position of the load pocket
+    Step_Spin,              // arg: spindle direction, value: rpm
+    Step_SpinStart,         // arg: spindle direction, value: rpm, starts the spindle without waiting for the ramp
+    Step_SpinWait,          // waits for the remaining ramp time of the spindle started before
+    Step_Sense,             // samples the tool recognition sensor
+    Step_Recognize,         // moves through both recognition zones and stops the spindle
+    Step_SenseRetract,      // arg: reference, value: position, latches the IR beam changes on the way and samples the tool at zone 1
+    Step_Jump,              // arg: condition, jump: step executed next if the condition is met
+    Step_Barrier,           // waits till all queued motion is executed
+    Step_Pause,             // arg: message, pauses for manual intervention
+    Step_DustCover,         // arg: open
+    Step_DustCoverWait,     // waits till the dust cover is open
+    Step_Unloaded,          // arg: dropped into the pocket
+    Step_Loaded,            // arg: synchronize the position before
+    Step_SetTool,
+    Step_Restore,
+    Step_Tune               // arg: engage, records the sensed outcome of the engage for the auto tune
+} atc_opcode_t;
+
+// Positions of a step are Z machine coordinates or positions along the load axis of a pocket,
+// corrected by the pocket correction or relative to the magazine (*Axis).
+typedef enum {
+    Ref_Machine = 0,
+    Ref_Unload,
+    Ref_Load,
+    Ref_UnloadAxis,
+    Ref_LoadAxis
+} atc_reference_t;
+
+typedef enum {
+    Spin_Stop = 0,
+    Spin_CW,
+    Spin_CCW
+} atc_spin_t;
+
+// Conditions are inverted by RAPIDCHANGE_NOT.
+typedef enum {
+    Cond_Always = 0,
+    Cond_UnloadTool,
+    Cond_UnloadPocket,
+    Cond_LoadTool,
+    Cond_LoadPocket,
+    Cond_DirectTraverse,    // at traverse height above the magazine of the load pocket
+    Cond_OtherMagazine,     // at traverse height above another magazine than the one of the load pocket
+    Cond_ToolSensed,
+    Cond_ToolLoaded,
+    Cond_ToolThreaded,
+    Cond_UnloadRetry,       // counts the unload attempts, met while retries are left
+    Cond_UnloadPocketFree,  // the unload pocket is not known to be occupied
+    Cond_LoadPocketFilled,  // the load pocket is not known to be empty
+    Cond_Seated             // the nut seated during the engage
+} atc_condition_t;
+
+#define RAPIDCHANGE_NOT 0x80
+
+typedef enum {
+    Message_UnloadFailed = 0,
+    Message_UnloadNoPocket,
+    Message_LoadFailed,
+    Message_LoadNotThreaded,
+    Message_LoadNoPocket,
+    Message_UnloadPocketOccupied,
+    Message_LoadPocketEmpty
+} atc_message_t;
+
+typedef struct {
+    uint8_t op;
+    uint8_t arg;
+    uint8_t jump;
+    float   value;
+} atc_step_t;
+
+typedef struct {
+    bool tool;
+    bool loaded;
+    bool threaded;
+    bool seated;
+} atc_sensed_t;
+
+// State of the executed sequence evaluated by the jump conditions.
+typedef struct {
+    atc_change_plan_t *plan;
+    bool               at_pocket_traverse;
+    uint8_t            retries;
+    uint32_t           spin_started;
+    uint16_t           spin_ramp_time;
+    bool               spin_reversing;
+    atc_sensed_t       sensed;
+} atc_run_t;
+
+// Plunge of the engage with seat detection, queued in short moves while the spindle speed is sampled.
+typedef struct {
+    uint8_t axis;
+    float   position;
+    float   queued;
+} atc_plunge_t;
+
+// Estimate of the tool changes of a job, travel in mm between the pockets and the time in ms of its traverse.
+typedef struct {
+    uint32_t time;
+    float    travel;
+    uint8_t  pauses;
+} atc_job_t;
+
+// Tool change state kept in NVS to continue after a reset or a power loss, written at phase boundaries if changed.
+typedef struct {
+    tool_id_t tool_id;
+    uint8_t   pocket;
+    bool      tool_length_pending;
+} atc_checkpoint_t;
+
+// Blocks of the plugin stored in NVS, written by the foreground when the machine is idle
+// except for the checkpoint written at each phase boundary.
+typedef enum {
+    Store_Settings = 0,
+    Store_TloCache,
+    Store_PocketCorrection,
+    Store_PocketMap,
+    Store_Checkpoint,
+    Store_Tune,
+    Store_Occupancy,
+    Store_Count
+} atc_store_block_t;
+
+typedef struct {
+    nvs_address_t address;
+    uint8_t      *data;
+    uint16_t      size;
+} atc_store_t;
+
+// Stored in front of the settings without checksum, the settings are read with the stored size.
+typedef struct {
+    uint8_t  version;
+    uint8_t  magazines;
+    uint16_t size;
+} atc_settings_header_t;
+
+_Static_assert(sizeof(atc_settings_t) <= RAPIDCHANGE_SETTINGS_RESERVE, "RapidChange settings exceed RAPIDCHANGE_SETTINGS_RESERVE");
+
+typedef struct {
+    atc_phase_t       phase;
+    uint32_t          started;
+    uint32_t          phase_start;
+    atc_phase_times_t current;
+    uint8_t           head;
+    uint8_t           count;
+    atc_phase_times_t history[RAPIDCHANGE_TIMING_HISTORY];
+} atc_timing_t;
+
+static const char *atc_messages[] = {
+    "RapidChange: Failed to unload the current tool. Please unload the tool manually and cycle start to continue.",
+    "RapidChange: Current tool does not have an assigned pocket. Please unload the tool manually and cycle start to continue.",
+    "RapidChange: Failed to load the selected tool. Please load the tool manually and cycle start to continue.",
+    "RapidChange: Failed to properly thread the selected tool. Please reload the tool manually and cycle start to continue.",
+    "RapidChange: Selected tool does not have an assigned pocket. Please load the selected tool and cycle start to continue.",
+    "RapidChange: The pocket of the current tool is occupied. Please unload the tool manually and cycle start to continue.",
+    "RapidChange: The pocket of the selected tool is empty. Please load the selected tool manually and cycle start to continue."
+};
+
+static const char *atc_phase_names[] = {
+    "Record state",
+    "Dust cover open",
+    "Unload",
+    "Load",
+    "Set tool",
+    "Dust cover close",
+    "Restore state"
+};
+
 static atc_settings_t atc;
 static tool_data_t current_tool = {0}, *next_tool = NULL;
 static coord_data_t target = {0}, previous;
+static atc_timing_t timing = { .phase = Phase_Idle };
+static atc_recognition_t recognition = {0};
+static bool dust_cover_opening = false;
+static spindle_state_t spindle_state = {0};
+static float spindle_speed = 0.0f;
+static uint32_t dust_cover_started;
+static atc_tlo_cache_block_t tlo_cache = {0};
+static atc_change_plan_t change_plan = {0};
+static atc_pocket_correction_t pocket_correction[RAPIDCHANGE_MAX_POCKETS] = {0};
+static atc_pocket_t pocket_table[RAPIDCHANGE_MAX_POCKETS];
+static uint8_t n_pockets = 0;
+static uint8_t tool_pocket[RAPIDCHANGE_MAX_TOOLS];
+static uint8_t spindle_pocket = RAPIDCHANGE_NO_POCKET;
+static atc_pocket_map_t pocket_map = {0};
+static atc_pocket_map_t plan_map = {0};
+static atc_occupancy_t occupancy = {0};
+static atc_step_t sequence[RAPIDCHANGE_MAX_STEPS];
+static uint_fast8_t n_steps = 0;
+static uint8_t phase_step[Phase_Idle];
+static atc_checkpoint_t checkpoint = { .pocket = RAPIDCHANGE_NO_POCKET }, checkpoint_saved;
+static atc_run_t run = { .plan = &change_plan };
+static atc_tune_t tune[Engage_Count] = {0};
+static atc_store_t store[Store_Count] = {
+    { .data = (uint8_t *)&atc, .size = sizeof(atc_settings_t) },
+    { .data = (uint8_t *)&tlo_cache, .size = sizeof(atc_tlo_cache_block_t) },
+    { .data = (uint8_t *)pocket_correction, .size = sizeof(pocket_correction) },
+    { .data = (uint8_t *)&pocket_map, .size = sizeof(atc_pocket_map_t) },
+    { .data = (uint8_t *)&checkpoint, .size = sizeof(atc_checkpoint_t) },
+    { .data = (uint8_t *)tune, .size = sizeof(tune) },
+    { .data = (uint8_t *)&occupancy, .size = sizeof(atc_occupancy_t) }
+};
+static uint8_t store_dirty = 0;
+static uint32_t store_writes = 0;
+static volatile bool store_flush_pending = false;
+
+#if RAPIDCHANGE_DEBUG
+
+// Single producer, single consumer queue, messages are only written by the foreground task.
+// The reset handler may run in interrupt context so it does not log, the reset is logged by the foreground.
+typedef struct {
+    volatile uint_fast8_t head;
+    volatile uint_fast8_t tail;
+    volatile bool flush_pending;
+    uint16_t dropped;
+    char message[RAPIDCHANGE_LOG_QUEUE_SIZE][RAPIDCHANGE_LOG_LENGTH];
+} atc_log_t;
+
+static atc_log_t log_queue = {0};
+static struct {
+    volatile bool pending;
+    bool change;
+    tool_id_t current_tool;
+    tool_id_t next_tool;
+} reset_log = {0};
+
+static void log_flush (void *data)
+{
+    log_queue.flush_pending = false;
+
+    while(log_queue.tail != log_queue.head) {
+        hal.stream.write("[R-ATC]: ");
+        hal.stream.write(log_queue.message[log_queue.tail]);
+        hal.stream.write(ASCII_EOL);
+        log_queue.tail = (log_queue.tail + 1) & (RAPIDCHANGE_LOG_QUEUE_SIZE - 1);
+    }
+
+    if(log_queue.dropped) {
+        hal.stream.write("[R-ATC]: ");
+        hal.stream.write(uitoa(log_queue.dropped));
+        hal.stream.write(" message(s) dropped" ASCII_EOL);
+        log_queue.dropped = 0;
+    }
+}
+
+static void log_message (uint_fast8_t level, const char *format, ...)
+{
+    if(level > atc.log_level)
+        return;
+
+    uint_fast8_t head = log_queue.head, next = (head + 1) & (RAPIDCHANGE_LOG_QUEUE_SIZE - 1);
+
+    if(next == log_queue.tail)
+        log_queue.dropped++;
+    else {
+        va_list args;
+        va_start(args, format);
+        vsnprintf(log_queue.message[head], RAPIDCHANGE_LOG_LENGTH, format, args);
+        va_end(args);
+        log_queue.head = next;
+    }
+
+    if(!log_queue.flush_pending)
+        log_queue.flush_pending = protocol_enqueue_foreground_task(log_flush, NULL);
+}
+
+#endif
 static driver_reset_ptr driver_reset = NULL;
 static on_report_options_ptr on_report_options;
+static on_execute_realtime_ptr on_execute_realtime;
+static on_realtime_report_ptr on_realtime_report;
 
 static atc_ports_t ports;
 static uint8_t n_in_ports;
@@ -111,10 +660,31 @@ static const setting_group_detail_t atc_groups [] = {
     { Group_Root, Group_UserSettings, "RapidChange ATC"}
 };
 
+// Magazine of a load axis setting.
+static uint_fast8_t setting_magazine (setting_id_t id)
+{
+    return id < 980 ? 0 : id < 990 ? 1 : 2;
+}
+
 static uint32_t atc_get_int (setting_id_t id)
 {
     uint32_t value = 0;
     switch((uint32_t)id) {
+        case 902:
+        case 982:
+        case 992:
+            value = atc.magazine[setting_magazine(id)].number_of_pockets;
+            break;
+        case 907:
+        case 986:
+        case 996:
+            value = atc.magazine[setting_magazine(id)].first_tool;
+            break;
+        case 908:
+        case 987:
+        case 997:
+            value = bit(atc.load[setting_magazine(id)].axis);
+            break;
         case 950:
             value = atc.dust_cover;
             break;
@@ -149,6 +719,64 @@ static status_code_t set_dust_cover_axis_mask (setting_id_t id, uint_fast16_t in
     return Status_OK;
 }
 
+// Check if the pockets of all magazines with the given layout of a magazine fit the pocket table
+// and hold tool numbers up to RAPIDCHANGE_MAX_TOOLS only.
+static bool pocket_layout_fits (uint_fast8_t magazine, uint_fast16_t number_of_pockets, uint_fast16_t first_tool)
+{
+    uint_fast16_t n_pockets = 0;
+    uint32_t tool_id = 1;
+
+    for(uint_fast8_t idx = 0; idx < RAPIDCHANGE_MAGAZINES; idx++) {
+        uint_fast16_t pockets = idx == magazine ? number_of_pockets : atc.magazine[idx].number_of_pockets;
+        uint_fast16_t first = idx == magazine ? first_tool : atc.magazine[idx].first_tool;
+
+        if(first)
+            tool_id = first;
+        if(pockets && tool_id + pockets - 1 > RAPIDCHANGE_MAX_TOOLS)
+            return false;
+
+        tool_id += pockets;
+        n_pockets += pockets;
+    }
+
+    return n_pockets <= RAPIDCHANGE_MAX_POCKETS;
+}
+
+static status_code_t set_number_of_pockets (setting_id_t id, uint_fast16_t int_value)
+{
+    atc_magazine_t *magazine = &atc.magazine[setting_magazine(id)];
+
+    if(!pocket_layout_fits(setting_magazine(id), int_value, magazine->first_tool))
+        return Status_InvalidStatement;
+
+    magazine->number_of_pockets = int_value;
+
+    return Status_OK;
+}
+
+static status_code_t set_first_tool (setting_id_t id, uint_fast16_t int_value)
+{
+    atc_magazine_t *magazine = &atc.magazine[setting_magazine(id)];
+
+    if(!pocket_layout_fits(setting_magazine(id), magazine->number_of_pockets, int_value))
+        return Status_InvalidStatement;
+
+    magazine->first_tool = int_value;
+
+    return Status_OK;
+}
+
+static status_code_t set_load_axis_mask (setting_id_t id, uint_fast16_t int_value)
+{
+    // Allow only one bit / axis set
+    if (!(int_value && !(int_value & (int_value-1))))
+        return Status_InvalidStatement;
+
+    atc.load[setting_magazine(id)].axis = log2(int_value);
+
+    return Status_OK;
+}
+
 static bool is_setting_available (const setting_detail_t *setting)
 {
     bool available = false;
@@ -161,22 +789,105 @@ static bool is_setting_available (const setting_detail_t *setting)
         case 935:
         case 936:
         case 937:
+        case 938:
+        case 970:
+            available = atc.tool_setter;
+            break;
+        case 915:
+            available = atc.load[0].axis != Z_AXIS;
+            break;
+        case 917:
+        case 918:
+        case 919:
+            available = atc.park;
+            break;
+        case 964:
+            available = atc.spindle_traverse;
+            break;
+        case 967:
+        case 968:
+            available = atc.seat_detection;
+            break;
+        case 973:
+        case 976:
             available = atc.tool_setter;
             break;
+        case 974:
+        case 975:
+            available = atc.tool_setter && atc.tool_setter_touches > 1;
+            break;
+        case 971:
+        case 972:
+            available = atc.tool_setter && atc.tlo_cache;
+            break;
+        case 939:
+            available = atc.tool_setter && atc.tool_setter_fast_reprobe;
+            break;
+        case 926:
+            available = atc.tool_recognition;
+            break;
+        case 927:
+        case 928:
+        case 929:
+            available = atc.tool_recognition && atc.engage_tune;
+            break;
         case 941:
             available = atc.tool_recognition && ports.tool_recognition != 0xFF;
             break;
         case 942:
         case 943:
+        case 944:
+        case 946:
             available = atc.tool_recognition;
             break;
+        case 945:
+            available = atc.tool_recognition && atc.tool_recognition_on_the_fly;
+            break;
         case 951:
         case 952:
         case 953:
             available = atc.dust_cover == DustCover_UseAxis;
             break;
+        case 954:
+        case 956:
+            available = atc.dust_cover == DustCover_UsePort;
+            break;
+        case 957:
+            available = atc.dust_cover == DustCover_UsePort && atc.dust_cover_feedback && n_in_ports > 1;
+            break;
         case 955:
             available = atc.dust_cover == DustCover_UsePort && ports.dust_cover != 0xFF;
+            break;
+#if RAPIDCHANGE_MAGAZINES > 1
+        case 980:
+        case 981:
+        case 983:
+        case 984:
+        case 985:
+        case 986:
+        case 987:
+        case 988:
+            available = atc.magazine[1].number_of_pockets != 0;
+            break;
+        case 989:
+            available = atc.magazine[1].number_of_pockets != 0 && atc.load[1].axis != Z_AXIS;
+            break;
+#endif
+#if RAPIDCHANGE_MAGAZINES > 2
+        case 990:
+        case 991:
+        case 993:
+        case 994:
+        case 995:
+        case 996:
+        case 997:
+        case 998:
+            available = atc.magazine[2].number_of_pockets != 0;
+            break;
+        case 999:
+            available = atc.magazine[2].number_of_pockets != 0 && atc.load[2].axis != Z_AXIS;
+            break;
+#endif
         default:
             break;
     }
@@ -185,21 +896,36 @@ static bool is_setting_available (const setting_detail_t *setting)
 }
 
 static const setting_detail_t atc_settings[] = {
-    { 900, Group_UserSettings, "Alignment", "Axis", Format_RadioButtons, "X,Y", NULL, NULL, Setting_NonCore, &atc.alignment, NULL, NULL },
-    { 901, Group_UserSettings, "Direction", NULL, Format_RadioButtons, "Positive,Negative", NULL, NULL, Setting_NonCore, &atc.direction, NULL, NULL },
-    { 902, Group_UserSettings, "Number of tool pockets", NULL, Format_Int8, "#00", "0", "9999", Setting_NonCore, &atc.number_of_pockets, NULL, NULL },
-    { 903, Group_UserSettings, "Pocket Offset", "mm", Format_Decimal, "###0", "0",  "9999.999", Setting_NonCore, &atc.pocket_offset, NULL, NULL },
-    { 904, Group_UserSettings, "Pocket 1 X Position", "mm", Format_Decimal, "-###0.000", "-9999.999", "9999.999", Setting_NonCore, &atc.x_pocket_1, NULL, NULL },
-    { 905, Group_UserSettings, "Pocket 1 Y Position", "mm", Format_Decimal, "-###0.000", "-9999.999", "9999.999", Setting_NonCore, &atc.y_pocket_1, NULL, NULL },
+    { 900, Group_UserSettings, "Alignment", "Axis", Format_RadioButtons, "X,Y", NULL, NULL, Setting_NonCore, &atc.magazine[0].alignment, NULL, NULL },
+    { 901, Group_UserSettings, "Direction", NULL, Format_RadioButtons, "Positive,Negative", NULL, NULL, Setting_NonCore, &atc.magazine[0].direction, NULL, NULL },
+    { 902, Group_UserSettings, "Number of tool pockets", NULL, Format_Int8, "##0", "0", RAPIDCHANGE_XSTR(RAPIDCHANGE_MAX_POCKETS), Setting_NonCoreFn, set_number_of_pockets, atc_get_int, NULL },
+    { 903, Group_UserSettings, "Pocket Offset", "mm", Format_Decimal, "###0", "0",  "9999.999", Setting_NonCore, &atc.magazine[0].pocket_offset, NULL, NULL },
+    { 904, Group_UserSettings, "Pocket 1 X Position", "mm", Format_Decimal, "-###0.000", "-9999.999", "9999.999", Setting_NonCore, &atc.magazine[0].x_pocket_1, NULL, NULL },
+    { 905, Group_UserSettings, "Pocket 1 Y Position", "mm", Format_Decimal, "-###0.000", "-9999.999", "9999.999", Setting_NonCore, &atc.magazine[0].y_pocket_1, NULL, NULL },
+    { 906, Group_UserSettings, "Pocket Direct Traverse", NULL, Format_RadioButtons, "Disabled, Enabled", NULL, NULL, Setting_NonCore, &atc.direct_traverse, NULL, NULL },
+    { 907, Group_UserSettings, "Pocket 1 Tool Number", NULL, Format_Int16, "###0", "0", RAPIDCHANGE_XSTR(RAPIDCHANGE_MAX_TOOLS), Setting_NonCoreFn, set_first_tool, atc_get_int, NULL },
+    { 908, Group_UserSettings, "Load Axis", NULL, Format_AxisMask, NULL, NULL, NULL, Setting_NonCoreFn, set_load_axis_mask, atc_get_int, NULL },
+    { 909, Group_UserSettings, "Load Direction", NULL, Format_RadioButtons, "Positive,Negative", NULL, NULL, Setting_NonCore, &atc.load[0].direction, NULL, NULL },
     { 910, Group_UserSettings, "Pocket Z Start Offset", "mm", Format_Decimal, "-##0.000", "-9999.999", "9999.999", Setting_NonCore, &atc.z_start, NULL, NULL },
     { 911, Group_UserSettings, "Pocket Z Retract Offset", "mm", Format_Decimal, "-##0.000", "-9999.999", "9999.999", Setting_NonCore, &atc.z_retract, NULL, NULL },
     { 912, Group_UserSettings, "Pocket Z Engage", "mm", Format_Decimal, "-##0.000", "-9999.999", "9999.999", Setting_NonCore, &atc.z_engage, NULL, NULL },
     { 913, Group_UserSettings, "Pocket Z Traverse", "mm", Format_Decimal, "-##0.000", "-9999.999", "9999.999", Setting_NonCore, &atc.z_traverse, NULL, NULL },
     { 914, Group_UserSettings, "Pocket Z Safe Clearance", "mm", Format_Decimal, "-##0.000", "-9999.999", "9999.999", Setting_NonCore, &atc.z_safe_clearance, NULL, NULL },
+    { 915, Group_UserSettings, "Pocket 1 Z Position", "mm", Format_Decimal, "-##0.000", "-9999.999", "9999.999", Setting_NonCore, &atc.load[0].z_pocket_1, NULL, is_setting_available },
+    { 916, Group_UserSettings, "Manual Change Park", NULL, Format_RadioButtons, "Disabled, Enabled", NULL, NULL, Setting_NonCore, &atc.park, NULL, NULL },
+    { 917, Group_UserSettings, "Manual Change Park X Position", "mm", Format_Decimal, "-###0.000", "-9999.999", "9999.999", Setting_NonCore, &atc.park_x, NULL, is_setting_available },
+    { 918, Group_UserSettings, "Manual Change Park Y Position", "mm", Format_Decimal, "-###0.000", "-9999.999", "9999.999", Setting_NonCore, &atc.park_y, NULL, is_setting_available },
+    { 919, Group_UserSettings, "Manual Change Park Z Position", "mm", Format_Decimal, "-##0.000", "-9999.999", "9999.999", Setting_NonCore, &atc.park_z, NULL, is_setting_available },
     { 920, Group_UserSettings, "Pocket Engage Feed Rate", "mm/min", Format_Decimal, "###0", "0", "10000", Setting_NonCore, &atc.engage_feed_rate, NULL, NULL },
     { 921, Group_UserSettings, "Pocket Load Spindle RPM", "rpm", Format_Decimal, "###0", "0", "10000", Setting_NonCore, &atc.load_rpm, NULL, NULL },
     { 922, Group_UserSettings, "Pocket Unload Spindle RPM", "rpm", Format_Decimal, "###0", "0", "10000", Setting_NonCore, &atc.unload_rpm, NULL, NULL },
     { 923, Group_UserSettings, "Spindle Ramp-up Wait Time", "ms", Format_Int16, "###0", "0", "60000", Setting_NonCore, &atc.spindle_ramp_time, NULL, NULL },
+    { 924, Group_UserSettings, "Spindle Ramp-down Wait Time", "ms", Format_Int16, "###0", "0", "60000", Setting_NonCore, &atc.spindle_ramp_down_time, NULL, NULL },
+    { 925, Group_UserSettings, "Spindle Speed Feedback", NULL, Format_RadioButtons, "Disabled, Enabled", NULL, NULL, Setting_NonCore, &atc.spindle_feedback, NULL, NULL },
+    { 926, Group_UserSettings, "Engage Auto Tune", NULL, Format_RadioButtons, "Disabled, Enabled", NULL, NULL, Setting_NonCore, &atc.engage_tune, NULL, is_setting_available },
+    { 927, Group_UserSettings, "Auto Tune Max Feed Rate", "mm/min", Format_Decimal, "###0", "0", "10000", Setting_NonCore, &atc.tune_max_feed_rate, NULL, is_setting_available },
+    { 928, Group_UserSettings, "Auto Tune Max Spindle RPM", "rpm", Format_Decimal, "###0", "0", "10000", Setting_NonCore, &atc.tune_max_rpm, NULL, is_setting_available },
+    { 929, Group_UserSettings, "Auto Tune Success Rate", "%", Format_Int8, "##0", "0", "100", Setting_NonCore, &atc.tune_success_rate, NULL, is_setting_available },
     { 930, Group_UserSettings, "Tool Setter", NULL, Format_RadioButtons, "Disabled, Enabled", NULL, NULL, Setting_NonCore, &atc.tool_setter, NULL, NULL },
     { 931, Group_UserSettings, "Tool Setter X Position", "mm", Format_Decimal, "-###0.000", "-9999.999", "9999.999", Setting_NonCore, &atc.tool_setter_x, NULL, is_setting_available },
     { 932, Group_UserSettings, "Tool Setter Y Position", "mm", Format_Decimal, "-###0.000", "-9999.999", "9999.999", Setting_NonCore, &atc.tool_setter_y, NULL, is_setting_available },
@@ -208,15 +934,65 @@ static const setting_detail_t atc_settings[] = {
     { 935, Group_UserSettings, "Tool Setter Set Feed Rate", "mm/min", Format_Decimal, "###0", "0", "10000", Setting_NonCore, &atc.tool_setter_set_feed_rate, NULL, is_setting_available },
     { 936, Group_UserSettings, "Tool Setter Max Travel", "mm", Format_Decimal, "-##0.000", "-9999.999", "9999.999", Setting_NonCore, &atc.tool_setter_max_travel, NULL, is_setting_available },
     { 937, Group_UserSettings, "Tool Setter Seek Retreat", "mm", Format_Decimal, "-##0.000", "-9999.999", "9999.999", Setting_NonCore, &atc.tool_setter_seek_retreat, NULL, is_setting_available },
+    { 938, Group_UserSettings, "Tool Setter Fast Re-Probe", NULL, Format_RadioButtons, "Disabled, Enabled", NULL, NULL, Setting_NonCore, &atc.tool_setter_fast_reprobe, NULL, is_setting_available },
+    { 939, Group_UserSettings, "Tool Setter Re-Probe Clearance", "mm", Format_Decimal, "##0.000", "0", "999.999", Setting_NonCore, &atc.tool_setter_reprobe_clearance, NULL, is_setting_available },
     { 940, Group_UserSettings, "Tool Recognition", NULL, Format_RadioButtons, "Disabled, Enabled", NULL, NULL, Setting_NonCore, &atc.tool_recognition, NULL, NULL },
     { 941, Group_AuxPorts, "Tool Recognition Port", NULL, Format_Int8, "#0", "0", max_in_port, Setting_NonCore, &atc.tool_recognition_port, NULL, is_setting_available, { .reboot_required = On } },
     { 942, Group_UserSettings, "Tool Recognition Z Zone 1", "mm", Format_Decimal, "-##0.000", "-9999.999", "9999.999", Setting_NonCore, &atc.tool_recognition_z_zone_1, NULL, is_setting_available },
     { 943, Group_UserSettings, "Tool Recognition Z Zone 2", "mm", Format_Decimal, "-##0.000", "-9999.999", "9999.999", Setting_NonCore, &atc.tool_recognition_z_zone_2, NULL, is_setting_available },
+    { 944, Group_UserSettings, "Tool Recognition On The Fly", NULL, Format_RadioButtons, "Disabled, Enabled", NULL, NULL, Setting_NonCore, &atc.tool_recognition_on_the_fly, NULL, is_setting_available },
+    { 945, Group_UserSettings, "Tool Recognition Debounce", "mm", Format_Decimal, "#0.000", "0", "99.999", Setting_NonCore, &atc.tool_recognition_debounce, NULL, is_setting_available },
+    { 946, Group_UserSettings, "Tool Recognition Unload Retries", NULL, Format_Int8, "#0", "0", "9", Setting_NonCore, &atc.unload_retries, NULL, is_setting_available },
     { 950, Group_UserSettings, "Dust Cover", NULL, Format_RadioButtons, "Disabled, Axis, Port", NULL, NULL, Setting_NonCoreFn, set_dust_cover_mode, atc_get_int, NULL },
     { 951, Group_UserSettings, "Dust Cover Axis", NULL, Format_AxisMask, NULL, NULL, NULL, Setting_NonCoreFn, set_dust_cover_axis_mask, atc_get_int, is_setting_available },
     { 952, Group_UserSettings, "Dust Cover Axis Open Position", "mm", Format_Decimal, "-###0.000", "-9999.999", "9999.999", Setting_NonCore, &atc.dust_cover_axis_open, NULL, is_setting_available },
     { 953, Group_UserSettings, "Dust Cover Axis Close Position", "mm", Format_Decimal, "-###0.000", "-9999.999", "9999.999", Setting_NonCore, &atc.dust_cover_axis_close, NULL, is_setting_available },
+    { 954, Group_UserSettings, "Dust Cover Port Delay", "ms", Format_Int16, "###0", "0", "60000", Setting_NonCore, &atc.dust_cover_port_delay, NULL, is_setting_available },
     { 955, Group_AuxPorts, "Dust Cover Port", NULL, Format_Int8, "#0", "0", max_out_port, Setting_NonCore, &atc.dust_cover_port, NULL, is_setting_available, { .reboot_required = On } },
+    { 956, Group_UserSettings, "Dust Cover Open Feedback", NULL, Format_RadioButtons, "Disabled, Enabled", NULL, NULL, Setting_NonCore, &atc.dust_cover_feedback, NULL, is_setting_available, { .reboot_required = On } },
+    { 957, Group_AuxPorts, "Dust Cover Feedback Port", NULL, Format_Int8, "#0", "0", max_in_port, Setting_NonCore, &atc.dust_cover_feedback_port, NULL, is_setting_available, { .reboot_required = On } },
+    { 960, Group_UserSettings, "Planned Sequence", NULL, Format_RadioButtons, "Disabled, Enabled", NULL, NULL, Setting_NonCore, &atc.planned_sequence, NULL, NULL },
+    { 962, Group_UserSettings, "Dynamic Pocket Assignment", NULL, Format_RadioButtons, "Disabled, Enabled", NULL, NULL, Setting_NonCore, &atc.dynamic_pockets, NULL, NULL },
+    { 963, Group_UserSettings, "Spindle Running Traverse", NULL, Format_RadioButtons, "Disabled, Enabled", NULL, NULL, Setting_NonCore, &atc.spindle_traverse, NULL, NULL },
+    { 964, Group_UserSettings, "Spindle Reversal Time", "ms", Format_Int16, "###0", "0", "60000", Setting_NonCore, &atc.spindle_reversal_time, NULL, is_setting_available },
+    { 965, Group_UserSettings, "Pocket Occupancy Check", NULL, Format_RadioButtons, "Disabled, Enabled", NULL, NULL, Setting_NonCore, &atc.occupancy_check, NULL, NULL },
+    { 966, Group_UserSettings, "Engage Seat Detection", NULL, Format_RadioButtons, "Disabled, Enabled", NULL, NULL, Setting_NonCore, &atc.seat_detection, NULL, NULL },
+    { 967, Group_UserSettings, "Engage Seat RPM Drop", "%", Format_Int8, "#0", "1", "99", Setting_NonCore, &atc.seat_rpm_drop, NULL, is_setting_available },
+    { 968, Group_UserSettings, "Engage Seat Window", "mm", Format_Decimal, "#0.000", "0", "99.999", Setting_NonCore, &atc.seat_window, NULL, is_setting_available },
+    { 970, Group_UserSettings, "Tool Length Cache", NULL, Format_RadioButtons, "Disabled, Enabled", NULL, NULL, Setting_NonCore, &atc.tlo_cache, NULL, is_setting_available },
+    { 971, Group_UserSettings, "Tool Length Cache Max Age", "changes", Format_Int16, "####0", "0", "65535", Setting_NonCore, &atc.tlo_cache_max_age, NULL, is_setting_available },
+    { 972, Group_UserSettings, "Tool Length Cache Max Uses", NULL, Format_Int8, "##0", "0", "255", Setting_NonCore, &atc.tlo_cache_max_uses, NULL, is_setting_available },
+    { 973, Group_UserSettings, "Tool Setter Touches", NULL, Format_Int8, "#0", "1", "9", Setting_NonCore, &atc.tool_setter_touches, NULL, is_setting_available },
+    { 974, Group_UserSettings, "Tool Setter Touch Retract", "mm", Format_Decimal, "#0.000", "0", "99.999", Setting_NonCore, &atc.tool_setter_touch_retract, NULL, is_setting_available },
+    { 975, Group_UserSettings, "Tool Setter Touch Tolerance", "mm", Format_Decimal, "#0.000", "0", "9.999", Setting_NonCore, &atc.tool_setter_touch_tolerance, NULL, is_setting_available },
+    { 976, Group_UserSettings, "Tool Setter Stored Length Tolerance", "mm", Format_Decimal, "#0.000", "0", "99.999", Setting_NonCore, &atc.tool_setter_cache_tolerance, NULL, is_setting_available },
+#if RAPIDCHANGE_MAGAZINES > 1
+    { 980, Group_UserSettings, "Magazine 2 Alignment", "Axis", Format_RadioButtons, "X,Y", NULL, NULL, Setting_NonCore, &atc.magazine[1].alignment, NULL, is_setting_available },
+    { 981, Group_UserSettings, "Magazine 2 Direction", NULL, Format_RadioButtons, "Positive,Negative", NULL, NULL, Setting_NonCore, &atc.magazine[1].direction, NULL, is_setting_available },
+    { 982, Group_UserSettings, "Magazine 2 Number of tool pockets", NULL, Format_Int8, "##0", "0", RAPIDCHANGE_XSTR(RAPIDCHANGE_MAX_POCKETS), Setting_NonCoreFn, set_number_of_pockets, atc_get_int, NULL },
+    { 983, Group_UserSettings, "Magazine 2 Pocket Offset", "mm", Format_Decimal, "###0", "0",  "9999.999", Setting_NonCore, &atc.magazine[1].pocket_offset, NULL, is_setting_available },
+    { 984, Group_UserSettings, "Magazine 2 Pocket 1 X Position", "mm", Format_Decimal, "-###0.000", "-9999.999", "9999.999", Setting_NonCore, &atc.magazine[1].x_pocket_1, NULL, is_setting_available },
+    { 985, Group_UserSettings, "Magazine 2 Pocket 1 Y Position", "mm", Format_Decimal, "-###0.000", "-9999.999", "9999.999", Setting_NonCore, &atc.magazine[1].y_pocket_1, NULL, is_setting_available },
+    { 986, Group_UserSettings, "Magazine 2 Pocket 1 Tool Number", NULL, Format_Int16, "###0", "0", RAPIDCHANGE_XSTR(RAPIDCHANGE_MAX_TOOLS), Setting_NonCoreFn, set_first_tool, atc_get_int, is_setting_available },
+    { 987, Group_UserSettings, "Magazine 2 Load Axis", NULL, Format_AxisMask, NULL, NULL, NULL, Setting_NonCoreFn, set_load_axis_mask, atc_get_int, is_setting_available },
+    { 988, Group_UserSettings, "Magazine 2 Load Direction", NULL, Format_RadioButtons, "Positive,Negative", NULL, NULL, Setting_NonCore, &atc.load[1].direction, NULL, is_setting_available },
+    { 989, Group_UserSettings, "Magazine 2 Pocket 1 Z Position", "mm", Format_Decimal, "-##0.000", "-9999.999", "9999.999", Setting_NonCore, &atc.load[1].z_pocket_1, NULL, is_setting_available },
+#endif
+#if RAPIDCHANGE_MAGAZINES > 2
+    { 990, Group_UserSettings, "Magazine 3 Alignment", "Axis", Format_RadioButtons, "X,Y", NULL, NULL, Setting_NonCore, &atc.magazine[2].alignment, NULL, is_setting_available },
+    { 991, Group_UserSettings, "Magazine 3 Direction", NULL, Format_RadioButtons, "Positive,Negative", NULL, NULL, Setting_NonCore, &atc.magazine[2].direction, NULL, is_setting_available },
+    { 992, Group_UserSettings, "Magazine 3 Number of tool pockets", NULL, Format_Int8, "##0", "0", RAPIDCHANGE_XSTR(RAPIDCHANGE_MAX_POCKETS), Setting_NonCoreFn, set_number_of_pockets, atc_get_int, NULL },
+    { 993, Group_UserSettings, "Magazine 3 Pocket Offset", "mm", Format_Decimal, "###0", "0",  "9999.999", Setting_NonCore, &atc.magazine[2].pocket_offset, NULL, is_setting_available },
+    { 994, Group_UserSettings, "Magazine 3 Pocket 1 X Position", "mm", Format_Decimal, "-###0.000", "-9999.999", "9999.999", Setting_NonCore, &atc.magazine[2].x_pocket_1, NULL, is_setting_available },
+    { 995, Group_UserSettings, "Magazine 3 Pocket 1 Y Position", "mm", Format_Decimal, "-###0.000", "-9999.999", "9999.999", Setting_NonCore, &atc.magazine[2].y_pocket_1, NULL, is_setting_available },
+    { 996, Group_UserSettings, "Magazine 3 Pocket 1 Tool Number", NULL, Format_Int16, "###0", "0", RAPIDCHANGE_XSTR(RAPIDCHANGE_MAX_TOOLS), Setting_NonCoreFn, set_first_tool, atc_get_int, is_setting_available },
+    { 997, Group_UserSettings, "Magazine 3 Load Axis", NULL, Format_AxisMask, NULL, NULL, NULL, Setting_NonCoreFn, set_load_axis_mask, atc_get_int, is_setting_available },
+    { 998, Group_UserSettings, "Magazine 3 Load Direction", NULL, Format_RadioButtons, "Positive,Negative", NULL, NULL, Setting_NonCore, &atc.load[2].direction, NULL, is_setting_available },
+    { 999, Group_UserSettings, "Magazine 3 Pocket 1 Z Position", "mm", Format_Decimal, "-##0.000", "-9999.999", "9999.999", Setting_NonCore, &atc.load[2].z_pocket_1, NULL, is_setting_available },
+#endif
+#if RAPIDCHANGE_DEBUG
+    { 961, Group_UserSettings, "Log Level", NULL, Format_RadioButtons, "Off, Error, Warning, Info, Debug", NULL, NULL, Setting_NonCore, &atc.log_level, NULL, NULL },
+#endif
 };
 
 #ifndef NO_SETTINGS_DESCRIPTIONS
@@ -224,19 +1000,37 @@ static const setting_detail_t atc_settings[] = {
 static const setting_descr_t atc_descriptions[] = {
     { 900, "Value: X Axis or Y Axis\\n\\nThe axis along which the tool pockets of the magazine are aligned in the XY plane." },
     { 901, "Value: Positive or Negative\\n\\nThe direction of travel along the alignment axis from pocket 1 to pocket 2, either positive or negative." },
-    { 902, "Value: Count\\n\\nThe total number of pockets in the magazine that may be occupied by a tool." },
+    { 902, "Value: Count\\n\\nThe total number of pockets in the magazine that may be occupied by a tool. All magazines together hold up to " RAPIDCHANGE_XSTR(RAPIDCHANGE_MAX_POCKETS) " pockets." },
     { 903, "Value: Distance (mm)\\n\\nThe distance from one pocket to the next when measuring from center to center." },
     { 904, "Value: X Machine Coordinate (mm)\\n\\nThe X axis position referencing the center of the first tool pocket." },
     { 905, "Value: Y Machine Coordinate (mm)\\n\\nThe Y axis position referencing the center of the first tool pocket." },
+    { 906, "Value: Enabled or Disabled\\n\\nMoves from the unload pocket directly to the load pocket. The descent from Z Traverse to the Z Start position is blended into the traverse across the last pocket distance, so no other pocket is passed below Z Traverse. Pockets of another magazine are approached at Z Safe Clearance." },
+    { 907, "Value: Tool Number\\n\\nThe tool number of the first pocket, the following pockets hold the next tool numbers up to tool " RAPIDCHANGE_XSTR(RAPIDCHANGE_MAX_TOOLS) "." },
+    { 908, "Value: Axis\\n\\nThe axis along which the spindle moves into the pockets, Z for a magazine loaded from above. "
+           "For another axis the Z positions of the engage, traverse and recognition settings are taken along the load axis from the Pocket 1 X or Y Position, or from 0 for a rotary axis, "
+           "and the pockets are approached at the Pocket 1 Z Position. The spindle retracts to the traverse position before moving to Z Safe Clearance." },
+    { 909, "Value: Positive or Negative\\n\\nThe direction of travel along the load axis into the pockets, negative for a magazine loaded from above." },
     { 910, "Value: Z Machine Coordinate Offset (mm)\\n\\nThe Z offset added to Z Engage at which the spindle is started for (dis-)engagement." },
     { 911, "Value: Z Machine Coordinate Offset (mm)\\n\\nThe Z offset added to Z Engage at which the spindle is retracted between engagement." },
     { 912, "Value: Z Machine Coordinate (mm)\\n\\nThe Z position to which the spindle plunges when engaging the clamping nut." },
     { 913, "Value: Z Machine Coordinate (mm)\\n\\nThe Z position at which the spindle traverses the magazine between dropping off and picking up a tool." },
     { 914, "Value: Z Machine Coordinate (mm)\\n\\nThe Z position for safe clearances of all obstacles." },
+    { 915, "Value: Z Machine Coordinate (mm)\\n\\nThe Z position of the pocket centers of a magazine not loaded along Z." },
+    { 916, "Value: Enabled or Disabled\\n\\nMoves the spindle to the park position before pausing for a manual change, rising to the safe clearance first. On cycle start the spindle rises to the safe clearance again and the tool change continues with the next step." },
+    { 917, "Value: X Machine Coordinate (mm)\\n\\nThe X axis position at which the spindle is parked for a manual change." },
+    { 918, "Value: Y Machine Coordinate (mm)\\n\\nThe Y axis position at which the spindle is parked for a manual change." },
+    { 919, "Value: Z Machine Coordinate (mm)\\n\\nThe Z position at which the spindle is parked for a manual change, the spindle descends from the safe clearance at the park position." },
     { 920, "Value: Feed Rate (mm/min)\\n\\nThe feed rate at which the spindle moves when (dis-)engaging the clamping nut." },
     { 921, "Value: Spindle Speed (rpm)\\n\\nThe rpm at which to operate the spindle when loading a tool." },
     { 922, "Value: Spindle Speed (rpm)\\n\\nThe rpm at which to operate the spindle when unloading a tool." },
-    { 923, "Value: Spindle Ramp-up Wait Time (ms)\\n\\nThe wait time till the spindle reaches the (un-)load speed." },
+    { 923, "Value: Spindle Ramp-up Wait Time (ms)\\n\\nThe wait time till the spindle reaches the (un-)load speed. Not used if spindle speed feedback is enabled." },
+    { 924, "Value: Spindle Ramp-down Wait Time (ms)\\n\\nThe wait time till the spindle is stopped, 0 uses the ramp-up wait time. Not used if spindle speed feedback is enabled." },
+    { 925, "Value: Enabled or Disabled\\n\\nWaits for the spindle at speed signal or the spindle RPM reported by the spindle instead of the ramp wait times, if supported by the spindle. The wait times out after " RAPIDCHANGE_XSTR(RAPIDCHANGE_SPINDLE_TIMEOUT) " ms." },
+    { 926, "Value: Enabled or Disabled\\n\\nRaises the engage feed rate and the (un-)load spindle speeds step by step from the settings above towards the auto tune limits while the tool recognition confirms the engages at the success rate, and slows down again when it is missed. "
+           "The reached speeds are stored and reported by $RCTUNE, $RCTUNE=0 restarts at the settings above." },
+    { 927, "Value: Feed Rate (mm/min)\\n\\nThe highest engage feed rate tried by the auto tune." },
+    { 928, "Value: Spindle Speed (rpm)\\n\\nThe highest (un-)load spindle speed tried by the auto tune." },
+    { 929, "Value: Percent\\n\\nThe share of engages at a speed that have to be successful, otherwise the auto tune slows down." },
     { 930, "Value: Enabled or Disabled\\n\\nAllows for enabling or disabling setting the tool offset during a tool change. This can be useful when configuring your magazine or performing diagnostics to shorten the tool change cycle." },
     { 931, "Value: X Machine Coordinate (mm)\\n\\nThe X axis position referencing the center of the tool setter." },
     { 932, "Value: Y Machine Coordinate (mm)\\n\\nThe Y axis position referencing the center of the tool setter." },
@@ -245,49 +1039,200 @@ static const setting_descr_t atc_descriptions[] = {
     { 935, "Value: Feed Rate (mm/min)\\n\\nThe feed rate to slowly engage tool change sensor to determine the tool offset accurately." },
     { 936, "Value: Distance (mm)\\n\\nThe maximum probing distance for tool setting." },
     { 937, "Value: Distance (mm)\\n\\nThe pull-off distance for the retract move before the slower locating phase." },
+    { 938, "Value: Enabled or Disabled\\n\\nSkips the seek phase for tools which were already probed. The spindle moves to the re-probe clearance above the last trigger position and only the slower locating phase is performed. If the tool setter is not found, the full probe cycle is performed." },
+    { 939, "Value: Distance (mm)\\n\\nThe distance above the last trigger position of the tool at which the slower locating phase starts. This move is a rapid, the distance has to cover changes of the tool length in the pocket." },
     { 940, "Value: Enabled or Disabled\\n\\nEnables or disables tool recognition as part of an automatic tool change. If tool recognition is included with your magazine, be sure to properly configure the appropriate settings before enabling." },
     { 941, "Aux input port number to use for tool recognition IR sensor." },
     { 942, "Value: Z Machine Coordinate (mm)\\n\\nThe Z position at which the clamping nut breaks the IR beam otherwise the nut is not loaded." },
     { 943, "Value: Z Machine Coordinate (mm)\\n\\nThe Z position at which the clamping nut should not break the IR beam otherwise it is not properly threaded." },
+    { 944, "Value: Enabled or Disabled\\n\\nLatches the Z positions at which the IR beam is broken or cleared while moving through both recognition zones in one move instead of stopping at each zone. Requires interrupt support of the tool recognition port." },
+    { 945, "Value: Distance (mm)\\n\\nIR beam changes which are reverted within this distance are ignored as noise." },
+    { 946, "Value: Count\\n\\nThe number of further unload attempts when the tool is still sensed at zone 1 before pausing for a manual unload. "
+           "With on the fly recognition the tool is sensed while retracting to Z Traverse, a dropped tool does not stop at zone 1." },
     { 950, "Disabled: Dust cover is disabled. \\n\\n"
            "Axis: Use axis to open and close dust cover.\\n\\n"
            "Port: Open and close dust cover via output port.\\n\\n" },
     { 951, "Value: Axis\\n\\nThe axis which controls the dust cover." },
     { 952, "Value: Dust Cover Axis Machine Coordinate (mm)\\n\\nThe dust cover axis position referencing an open dust cover." },
     { 953, "Value: Dust Cover Axis Machine Coordinate (mm)\\n\\nThe dust cover axis position referencing a closed dust cover." },
+    { 954, "Value: Wait Time (ms)\\n\\nThe time the dust cover needs to open. The spindle moves towards the magazine meanwhile and only waits before descending into it. Used as timeout if the open feedback is enabled." },
     { 955, "Aux output port number to use for dust cover control (High is open, low is close)." },
+    { 956, "Value: Enabled or Disabled\\n\\nWaits for a sensor confirming the open dust cover instead of the dust cover port delay." },
+    { 957, "Aux input port number to use for the dust cover open sensor (High is open)." },
+    { 960, "Value: Enabled or Disabled\\n\\nQueues moves which do not require a sensor read or a spindle state change back-to-back instead of waiting for each move to complete. The motion is only synchronized at the spindle start / stop, tool recognition and probing." },
+    { 962, "Value: Enabled or Disabled\\n\\nReturns the unloaded tool to the empty pocket with the shortest traverse to the pocket of the next tool instead of its own pocket. "
+           "The tools held by the pockets are stored and reported by $RCPOCKET, $RCMAP=<pocket>,<tool> assigns a tool to a pocket, 0 empties the pocket, $RCMAP=0 restores the magazine layout." },
+    { 963, "Value: Enabled or Disabled\\n\\nKeeps the spindle running after a tool was unloaded and starts the load direction at traverse height, so the spindle ramps while moving to the load pocket. "
+           "Before the engage only the remaining ramp time is waited for. The spindle is stopped before pausing for a manual load." },
+    { 964, "Value: Wait Time (ms)\\n\\nThe time the spindle needs to reverse from the unload to the load speed without stopping, spindle feedback is not used while reversing. "
+           "0 stops the spindle with the full ramp-down wait time before starting the load direction, for spindles which do not allow a direct reversal." },
+    { 965, "Value: Enabled or Disabled\\n\\nPauses for a manual change before moving into the magazine if the unload pocket is known to be occupied or the load pocket is known to be empty. "
+           "The pockets are known from the tool changes, outcomes confirmed by the tool recognition if enabled. $RCOCCUPY reports them, $RCOCCUPY=<pocket>,<0|1> sets a pocket empty or occupied, $RCOCCUPY=0 forgets all pockets." },
+    { 966, "Value: Enabled or Disabled\\n\\nSamples the spindle speed feedback while engaging the clamping nut of the load pocket and ends the plunge when the speed drops as the nut seats, within the distance to stop from the engage feed rate plus 1 mm. "
+           "Without tool recognition a nut seating before the seat window is taken as cross-threaded and pauses for a manual load. Requires spindle RPM feedback, otherwise the plunge runs to the engage position." },
+    { 967, "Value: Percent\\n\\nThe drop of the spindle speed below the speed at the start of the plunge which detects the seated nut." },
+    { 968, "Value: Distance (mm)\\n\\nThe distance before the engage position within which the nut is expected to seat." },
+    { 970, "Value: Enabled or Disabled\\n\\nReuses the stored tool length of a tool measured before instead of moving to the tool setter. The tool length is measured again when it exceeds the max age or uses, or when it is invalidated with $RCTLO=<tool>. Requires the TLO reference to be established since startup." },
+    { 971, "Value: Count\\n\\nThe number of tool changes after which a stored tool length is measured again, 0 disables the limit." },
+    { 972, "Value: Count\\n\\nThe number of loads of a tool after which its stored tool length is measured again, 0 disables the limit." },
+    { 973, "Value: Count\\n\\nThe number of fine touches of a tool length measurement. With more than one touch the spindle retracts by the touch retract between the touches "
+           "and the median is taken if the majority of the touches is within the touch tolerance of it, otherwise the tool is probed again." },
+    { 974, "Value: Distance (mm)\\n\\nThe retract above the trigger position between the fine touches." },
+    { 975, "Value: Distance (mm)\\n\\nThe max deviation of a touch from the median of the touches, touches deviating more are rejected as outliers." },
+    { 976, "Value: Distance (mm)\\n\\nThe max deviation of a measured tool length from the stored length of the tool. A deviating tool length is probed again "
+           "and only taken if confirmed by the next measurement, 0 disables the check." },
+#if RAPIDCHANGE_MAGAZINES > 1
+    { 980, "Value: X Axis or Y Axis\\n\\nThe axis along which the tool pockets of magazine 2 are aligned in the XY plane." },
+    { 981, "Value: Positive or Negative\\n\\nThe direction of travel along the alignment axis from pocket 1 to pocket 2 of magazine 2, either positive or negative." },
+    { 982, "Value: Count\\n\\nThe total number of pockets in magazine 2 that may be occupied by a tool, 0 disables the magazine. The pockets are numbered after the pockets of magazine 1." },
+    { 983, "Value: Distance (mm)\\n\\nThe distance from one pocket of magazine 2 to the next when measuring from center to center." },
+    { 984, "Value: X Machine Coordinate (mm)\\n\\nThe X axis position referencing the center of the first tool pocket of magazine 2." },
+    { 985, "Value: Y Machine Coordinate (mm)\\n\\nThe Y axis position referencing the center of the first tool pocket of magazine 2." },
+    { 986, "Value: Tool Number\\n\\nThe tool number of the first pocket of magazine 2, 0 continues the tool numbers of magazine 1. A tool held by more than one magazine is loaded from the nearest pocket." },
+    { 987, "Value: Axis\\n\\nThe axis along which the spindle moves into the pockets of magazine 2, see $908." },
+    { 988, "Value: Positive or Negative\\n\\nThe direction of travel along the load axis into the pockets of magazine 2." },
+    { 989, "Value: Z Machine Coordinate (mm)\\n\\nThe Z position of the pocket centers of magazine 2 if not loaded along Z." },
+#endif
+#if RAPIDCHANGE_MAGAZINES > 2
+    { 990, "Value: X Axis or Y Axis\\n\\nThe axis along which the tool pockets of magazine 3 are aligned in the XY plane." },
+    { 991, "Value: Positive or Negative\\n\\nThe direction of travel along the alignment axis from pocket 1 to pocket 2 of magazine 3, either positive or negative." },
+    { 992, "Value: Count\\n\\nThe total number of pockets in magazine 3 that may be occupied by a tool, 0 disables the magazine. The pockets are numbered after the pockets of magazine 2." },
+    { 993, "Value: Distance (mm)\\n\\nThe distance from one pocket of magazine 3 to the next when measuring from center to center." },
+    { 994, "Value: X Machine Coordinate (mm)\\n\\nThe X axis position referencing the center of the first tool pocket of magazine 3." },
+    { 995, "Value: Y Machine Coordinate (mm)\\n\\nThe Y axis position referencing the center of the first tool pocket of magazine 3." },
+    { 996, "Value: Tool Number\\n\\nThe tool number of the first pocket of magazine 3, 0 continues the tool numbers of magazine 2. A tool held by more than one magazine is loaded from the nearest pocket." },
+    { 997, "Value: Axis\\n\\nThe axis along which the spindle moves into the pockets of magazine 3, see $908." },
+    { 998, "Value: Positive or Negative\\n\\nThe direction of travel along the load axis into the pockets of magazine 3." },
+    { 999, "Value: Z Machine Coordinate (mm)\\n\\nThe Z position of the pocket centers of magazine 3 if not loaded along Z." },
+#endif
+#if RAPIDCHANGE_DEBUG
+    { 961, "Value: Off, Error, Warning, Info or Debug\\n\\nThe level of the RapidChange messages printed in the normal stream. Levels above the one selected at compile time are not available." },
+#endif
 };
 
 #endif
 
+static void build_pocket_table (void);
+static void compile_sequence (void);
+
+// Persistent storage, the settings and statistics blocks are marked for writing and written together
+// when the machine is idle so they are not written during a tool change. The checkpoint is the one
+// exception: an aborted change is resumed from the checkpoint written before the abort, so it is
+// written at once at each phase boundary, if changed.
+static void store_save (atc_store_block_t block)
+{
+    store_dirty |= 1 << block;
+}
+
+static void store_write (atc_store_block_t block)
+{
+    atc_store_t *entry = &store[block];
+
+    if(entry->address == 0)
+        return;
+
+    store_writes++;
+    if(block == Store_Settings) {
+        atc_settings_header_t header = { .version = RAPIDCHANGE_SETTINGS_VERSION, .magazines = RAPIDCHANGE_MAGAZINES, .size = sizeof(atc_settings_t) };
+        hal.nvs.memcpy_to_nvs(entry->address, (uint8_t *)&header, sizeof(atc_settings_header_t), false);
+        hal.nvs.memcpy_to_nvs(entry->address + sizeof(atc_settings_header_t), entry->data, entry->size, true);
+    } else
+        hal.nvs.memcpy_to_nvs(entry->address, entry->data, entry->size, true);
+}
+
+// Read a block, the settings of an older layout are read over the defaults of the appended settings.
+static bool store_read (atc_store_block_t block)
+{
+    atc_store_t *entry = &store[block];
+
+    if(entry->address == 0)
+        return false;
+
+    if(block == Store_Settings) {
+        atc_settings_header_t header;
+        if(hal.nvs.memcpy_from_nvs((uint8_t *)&header, entry->address, sizeof(atc_settings_header_t), false) != NVS_TransferResult_OK ||
+            header.version != RAPIDCHANGE_SETTINGS_VERSION || header.magazines != RAPIDCHANGE_MAGAZINES ||
+             header.size == 0 || header.size > entry->size)
+            return false;
+        if(hal.nvs.memcpy_from_nvs(entry->data, entry->address + sizeof(atc_settings_header_t), header.size, true) != NVS_TransferResult_OK)
+            return false;
+        if(header.size < entry->size)
+            store_save(Store_Settings);
+        return true;
+    }
+
+    return hal.nvs.memcpy_from_nvs(entry->data, entry->address, entry->size, true) == NVS_TransferResult_OK;
+}
+
+static void store_flush (void)
+{
+    for(uint_fast8_t block = 0; block < Store_Count; block++) {
+        if(store_dirty & (1 << block))
+            store_write((atc_store_block_t)block);
+    }
+    store_dirty = 0;
+}
+
+// Write the marked blocks from the foreground when the machine is idle, or at once after a reset.
+static void store_poll (sys_state_t state)
+{
+    bool flush = store_flush_pending;
+
+    store_flush_pending = false;
+    if(store_dirty && (flush || (state == STATE_IDLE && timing.phase == Phase_Idle)))
+        store_flush();
+}
+
 // Hal settings API
-// Restore default settings and write to non volatile storage (NVS).
-static void atc_settings_restore (void)
+// Set the default settings.
+static void atc_settings_defaults (void)
 {
     memset(&atc, 0, sizeof(atc_settings_t));
-    atc.pocket_offset = 45.0f;
-    atc.x_pocket_1 = 0.0f;
-    atc.y_pocket_1 = 0.0f;
+    for(uint_fast8_t idx = 0; idx < RAPIDCHANGE_MAGAZINES; idx++) {
+        atc.magazine[idx].pocket_offset = 45.0f;
+        atc.magazine[idx].x_pocket_1 = 0.0f;
+        atc.magazine[idx].y_pocket_1 = 0.0f;
+        atc.load[idx].axis = Z_AXIS;
+        atc.load[idx].direction = 1;
+        atc.load[idx].z_pocket_1 = -10.0f;
+    }
+    atc.magazine[0].first_tool = 1;
     atc.z_start = 23.0f;
     atc.z_retract = 13.0f;
     atc.z_engage = -10.0f;
     atc.z_traverse = -10.0f;
     atc.z_safe_clearance = -10.0f;
+    atc.direct_traverse = false;
     atc.engage_feed_rate = 1800.0f;
     atc.load_rpm = 1200.0f;
     atc.unload_rpm = 1200.0f;
+    atc.spindle_ramp_time = 0;
+    atc.spindle_ramp_down_time = 0;
+    atc.spindle_feedback = false;
+    atc.engage_tune = false;
+    atc.tune_max_feed_rate = 3000.0f;
+    atc.tune_max_rpm = 2000.0f;
+    atc.tune_success_rate = 95;
 
     atc.tool_setter_z_seek_start = -10.0f;
     atc.tool_setter_seek_feed_rate = DEFAULT_TOOLCHANGE_SEEK_RATE;
     atc.tool_setter_set_feed_rate = DEFAULT_TOOLCHANGE_FEED_RATE;
     atc.tool_setter_max_travel = DEFAULT_TOOLCHANGE_PROBING_DISTANCE;
     atc.tool_setter_seek_retreat = 2.0f;
+    atc.tool_setter_fast_reprobe = false;
+    atc.tool_setter_reprobe_clearance = 5.0f;
+    atc.tlo_cache = false;
+    atc.tlo_cache_max_age = 50;
+    atc.tlo_cache_max_uses = 10;
 
     if(n_in_ports) {
         atc.tool_recognition_port = n_in_ports - 1;
     }
     atc.tool_recognition_z_zone_1 = -10.0f;
     atc.tool_recognition_z_zone_2 = -10.0f;
+    atc.tool_recognition_on_the_fly = false;
+    atc.tool_recognition_debounce = 0.5f;
+    atc.unload_retries = 1;
 
     atc.dust_cover = DustCover_Disabled;
     atc.dust_cover_axis = N_AXIS - 1;
@@ -296,42 +1241,191 @@ static void atc_settings_restore (void)
     if(n_out_ports) {
         atc.dust_cover_port = n_out_ports - 1;
     }
+    atc.dust_cover_port_delay = 1000;
+    atc.dust_cover_feedback = false;
+    if(n_in_ports > 1) {
+        atc.dust_cover_feedback_port = n_in_ports - 2;
+    }
+
+    atc.planned_sequence = false;
+    atc.dynamic_pockets = false;
+    atc.spindle_traverse = false;
+    atc.spindle_reversal_time = 0;
+    atc.occupancy_check = false;
+    atc.tool_setter_touches = 1;
+    atc.tool_setter_touch_retract = 0.5f;
+    atc.tool_setter_touch_tolerance = 0.02f;
+    atc.tool_setter_cache_tolerance = 0.0f;
+    atc.park = false;
+    atc.park_x = 0.0f;
+    atc.park_y = 0.0f;
+    atc.park_z = -10.0f;
+    atc.seat_detection = false;
+    atc.seat_rpm_drop = 20;
+    atc.seat_window = 3.0f;
+    atc.log_level = 0;
+
+}
+
+// Restore default settings and write to non volatile storage (NVS). The stored tool lengths, pocket corrections,
+// pocket map, auto tune and pocket occupancy are kept, they are cleared by $RCTLO=0, $RCPOCKET, $RCMAP=0,
+// $RCTUNE=0 and $RCOCCUPY=0.
+static void atc_settings_restore (void)
+{
+    atc_settings_defaults();
+    store_save(Store_Settings);
 
-    hal.nvs.memcpy_to_nvs(nvs_address, (uint8_t *)&atc, sizeof(atc_settings_t), true);
+    build_pocket_table();
+    compile_sequence();
 }
 
 // Write settings to non volatile storage (NVS).
 static void atc_settings_save (void)
 {
-    hal.nvs.memcpy_to_nvs(nvs_address, (uint8_t *)&atc, sizeof(atc_settings_t), true);
+    change_plan.valid = false;
+    build_pocket_table();
+    compile_sequence();
+    store_save(Store_Settings);
 }
 
-// Load settings from volatile storage (NVS)
-static void atc_settings_load (void)
+// Write the pocket corrections to non volatile storage (NVS).
+static void pocket_correction_save (void)
 {
-    if(hal.nvs.memcpy_from_nvs((uint8_t *)&atc, nvs_address, sizeof(atc_settings_t), true) != NVS_TransferResult_OK)
-        atc_settings_restore();
-
-    bool ok = true;
+    store_save(Store_PocketCorrection);
+}
 
-    ports.tool_recognition = 0xFE;
-    ports.dust_cover = 0xFE;
-    if(n_in_ports)  {
-        // Sanity check
-        if(atc.tool_recognition_port >= n_in_ports)
-            atc.tool_recognition_port = n_in_ports - 1;
+// Write the dynamic pocket map to non volatile storage (NVS).
+static void pocket_map_save (void)
+{
+    store_save(Store_PocketMap);
+}
 
-        ports.tool_recognition = atc.tool_recognition_port;
-        ok = ioport_claim(Port_Digital, Port_Input, &ports.tool_recognition, atc_port_names[0]);
+// Write the checkpoint to non volatile storage (NVS) if changed since the last write, also during a tool change.
+static void checkpoint_save (void)
+{
+    if(memcmp(&checkpoint, &checkpoint_saved, sizeof(atc_checkpoint_t))) {
+        memcpy(&checkpoint_saved, &checkpoint, sizeof(atc_checkpoint_t));
+        store_dirty &= ~(1 << Store_Checkpoint);
+        store_write(Store_Checkpoint);
     }
-    if(ok && n_out_ports)  {
-        // Sanity check
-        if(atc.dust_cover_port >= n_out_ports)
-            atc.dust_cover_port = n_out_ports - 1;
+}
+
+// Restore the tool in the spindle recorded before the restart, called after the parser is initialized.
+static void checkpoint_restore (void *data)
+{
+    if(grbl.tool_table.n_tools) {
+        if(checkpoint.tool_id <= grbl.tool_table.n_tools)
+            gc_state.tool = &grbl.tool_table.tool[checkpoint.tool_id];
+    } else
+        gc_state.tool->tool_id = checkpoint.tool_id;
+    gc_state.tool_pending = gc_state.tool->tool_id;
+    system_add_rt_report(Report_Tool);
+
+    report_info("RapidChange: Tool in the spindle restored from the last tool change.");
+}
+
+// Write the tool length cache to non volatile storage (NVS).
+static void tlo_cache_save (void)
+{
+    store_save(Store_TloCache);
+}
+
+// Write the auto tune state to non volatile storage (NVS).
+static void tune_save (void)
+{
+    store_save(Store_Tune);
+}
+
+// Load settings from volatile storage (NVS)
+static void atc_settings_load (void)
+{
+    change_plan.valid = false;
+
+    // Settings appended since the stored layout keep their defaults
+    atc_settings_defaults();
+    if(!store_read(Store_Settings))
+        atc_settings_restore();
+
+    if(store[Store_TloCache].address && !store_read(Store_TloCache)) {
+        memset(&tlo_cache, 0, sizeof(atc_tlo_cache_block_t));
+        tlo_cache_save();
+    }
+
+    if(store[Store_PocketCorrection].address && !store_read(Store_PocketCorrection)) {
+        memset(pocket_correction, 0, sizeof(pocket_correction));
+        pocket_correction_save();
+    }
+
+    if(store[Store_PocketMap].address && !store_read(Store_PocketMap)) {
+        memset(&pocket_map, 0, sizeof(atc_pocket_map_t));
+        pocket_map_save();
+    }
+
+    if(store[Store_Tune].address && !store_read(Store_Tune)) {
+        memset(tune, 0, sizeof(tune));
+        tune_save();
+    }
+
+    if(store[Store_Occupancy].address && !store_read(Store_Occupancy)) {
+        memset(&occupancy, 0, sizeof(atc_occupancy_t));
+        store_save(Store_Occupancy);
+    }
+
+    if(store[Store_Checkpoint].address) {
+        if(!store_read(Store_Checkpoint)) {
+            memset(&checkpoint, 0, sizeof(atc_checkpoint_t));
+            checkpoint.pocket = RAPIDCHANGE_NO_POCKET;
+            store_save(Store_Checkpoint);
+        }
+        memcpy(&checkpoint_saved, &checkpoint, sizeof(atc_checkpoint_t));
+
+        if(checkpoint.tool_id != current_tool.tool_id) {
+            current_tool.tool_id = checkpoint.tool_id;
+            spindle_pocket = checkpoint.pocket;
+            protocol_enqueue_foreground_task(checkpoint_restore, NULL);
+        }
+    }
+
+    build_pocket_table();
+    compile_sequence();
+
+    bool ok = true;
+
+    ports.tool_recognition = 0xFE;
+    ports.dust_cover = 0xFE;
+    ports.dust_cover_feedback = 0xFF;
+    if(n_in_ports)  {
+        // Sanity check
+        if(atc.tool_recognition_port >= n_in_ports)
+            atc.tool_recognition_port = n_in_ports - 1;
+
+        ports.tool_recognition = atc.tool_recognition_port;
+        ok = ioport_claim(Port_Digital, Port_Input, &ports.tool_recognition, atc_port_names[0]);
+    }
+    if(ok && n_out_ports)  {
+        // Sanity check
+        if(atc.dust_cover_port >= n_out_ports)
+            atc.dust_cover_port = n_out_ports - 1;
 
         ports.dust_cover = atc.dust_cover_port;
         ok = ioport_claim(Port_Digital, Port_Output, &ports.dust_cover, atc_port_names[1]);
     }
+    if(ok && n_in_ports && atc.dust_cover == DustCover_UsePort && atc.dust_cover_feedback)  {
+        // Sanity check, the fallback is the default port next to the tool recognition port
+        if(atc.dust_cover_feedback_port >= n_in_ports)
+            atc.dust_cover_feedback_port = n_in_ports > 1 ? n_in_ports - 2 : 0;
+
+        // The feedback cannot share the input claimed for the tool recognition sensor,
+        // ports claimed by others are rejected by ioport_claim().
+        if(atc.dust_cover_feedback_port == atc.tool_recognition_port)
+            ok = false;
+        else {
+            ports.dust_cover_feedback = atc.dust_cover_feedback_port;
+            ok = ioport_claim(Port_Digital, Port_Input, &ports.dust_cover_feedback, atc_port_names[2]);
+        }
+        if(!ok)
+            ports.dust_cover_feedback = 0xFF;
+    }
 
     if(!ok)
         protocol_enqueue_foreground_task(report_warning, "RapidChange: Configured port number(s) not available");
@@ -356,7 +1450,14 @@ static setting_details_t setting_details = {
 // Called from EXEC_RESET and EXEC_STOP handlers (via HAL).
 static void reset (void)
 {
-    RAPIDCHANGE_DEBUG_PRINT("Reset.");
+#if RAPIDCHANGE_DEBUG
+    reset_log.change = next_tool != NULL;
+    if(next_tool) {
+        reset_log.current_tool = current_tool.tool_id;
+        reset_log.next_tool = next_tool->tool_id;
+    }
+    reset_log.pending = true;
+#endif
     if(next_tool) { //TODO: move to gc_xxx() function?
         // Restore previous tool if reset is during change
         if(current_tool.tool_id != next_tool->tool_id) {
@@ -366,16 +1467,16 @@ static void reset (void)
                 memcpy(next_tool, &current_tool, sizeof(tool_data_t));
             system_add_rt_report(Report_Tool);
         }
-        char tool_msg[20];
-        sprintf(tool_msg, "Current tool: %lu", current_tool.tool_id);
-        RAPIDCHANGE_DEBUG_PRINT(tool_msg);
-        sprintf(tool_msg, "Next tool: %lu", next_tool->tool_id);
-        RAPIDCHANGE_DEBUG_PRINT(tool_msg);
 
         gc_state.tool_pending = gc_state.tool->tool_id;
         next_tool = NULL;
+        change_plan.valid = false;
     }
 
+    // Keep the tool change state of an aborted change, the blocks are written by the foreground
+    // since the reset may be called in interrupt context.
+    store_flush_pending = true;
+
     driver_reset();
 }
 
@@ -388,24 +1489,126 @@ static void report_options (bool newopt)
     }
 }
 
+// Append the tool change progress to the real time report while a tool change is running:
+// |RC:<phase>,<pocket>,<retries>,<elapsed ms> with the phase numbered from 0 (record state) and pocket 0 for none.
+static void realtime_report (stream_write_ptr stream_write, report_tracking_flags_t report)
+{
+    if(timing.phase != Phase_Idle) {
+        atc_pocket_plan_t *pocket = timing.phase <= Phase_Unload ? &change_plan.unload : &change_plan.load;
+
+        stream_write("|RC:");
+        stream_write(uitoa(timing.phase));
+        stream_write(",");
+        stream_write(uitoa(pocket->has_pocket ? pocket->pocket + 1 : 0));
+        stream_write(",");
+        stream_write(uitoa(run.retries));
+        stream_write(",");
+        stream_write(uitoa(hal.get_elapsed_ticks() - timing.started));
+    }
+
+    if(on_realtime_report)
+        on_realtime_report(stream_write, report);
+}
+
 // FluidNC port
-static coord_data_t calculate_tool_pos (tool_id_t tool_id) {
+static coord_data_t calculate_pocket_pos (atc_magazine_t *magazine, uint_fast8_t pocket) {
     coord_data_t target = {0};
     memset(&target, 0, sizeof(coord_data_t)); // Zero plan_data struct
-    target.x = atc.x_pocket_1;
-    target.y = atc.y_pocket_1;
+    target.x = magazine->x_pocket_1;
+    target.y = magazine->y_pocket_1;
 
-    int8_t multiplier = atc.direction ? -1 : 1;
-    float tool_offset = (tool_id - 1) * atc.pocket_offset * multiplier;
+    int8_t multiplier = magazine->direction ? -1 : 1;
+    float tool_offset = pocket * magazine->pocket_offset * multiplier;
 
-    if(atc.alignment == X_AXIS)
-        target.x = atc.x_pocket_1 + tool_offset;
-    else if(atc.alignment == Y_AXIS)
-        target.y = atc.y_pocket_1 + tool_offset;
+    if(magazine->alignment == X_AXIS)
+        target.x = magazine->x_pocket_1 + tool_offset;
+    else if(magazine->alignment == Y_AXIS)
+        target.y = magazine->y_pocket_1 + tool_offset;
 
     return target;
 }
 
+// Link the pockets holding the same tool, starting with the pocket of the first magazine.
+static void build_tool_index (void) {
+    memset(tool_pocket, RAPIDCHANGE_NO_POCKET, sizeof(tool_pocket));
+
+    for(uint_fast8_t idx = 0; idx < n_pockets; idx++) {
+        tool_id_t tool_id = pocket_table[idx].tool_id;
+
+        pocket_table[idx].next = RAPIDCHANGE_NO_POCKET;
+        if(tool_id == 0 || tool_id > RAPIDCHANGE_MAX_TOOLS)
+            continue;
+
+        uint8_t *link = &tool_pocket[tool_id - 1];
+        while(*link != RAPIDCHANGE_NO_POCKET)
+            link = &pocket_table[*link].next;
+        *link = idx;
+    }
+}
+
+// Assign the tools of the dynamic pocket map to the pockets, the map is initialized from the
+// magazine layout if the number of pockets was changed.
+static void apply_pocket_map (void) {
+    if(pocket_map.n_pockets != n_pockets) {
+        memset(&pocket_map, 0, sizeof(atc_pocket_map_t));
+        pocket_map.n_pockets = n_pockets;
+        for(uint_fast8_t idx = 0; idx < n_pockets; idx++)
+            pocket_map.tool[idx] = pocket_table[idx].tool_id;
+        pocket_map_save();
+    }
+
+    for(uint_fast8_t idx = 0; idx < n_pockets; idx++)
+        pocket_table[idx].tool_id = pocket_map.tool[idx];
+}
+
+// Rebuild the pockets of all magazines from the magazine settings and the pocket corrections.
+// The Z correction is stored as Z position of the pocket of a magazine loaded along Z.
+static void build_pocket_table (void) {
+    bool overflow = false;
+    tool_id_t tool_id = 1;
+
+    n_pockets = 0;
+
+    for(uint_fast8_t idx = 0; idx < RAPIDCHANGE_MAGAZINES; idx++) {
+        atc_magazine_t *magazine = &atc.magazine[idx];
+
+        if(magazine->first_tool)
+            tool_id = magazine->first_tool;
+
+        for(uint_fast8_t pocket = 0; pocket < magazine->number_of_pockets; pocket++, tool_id++) {
+            if(n_pockets == RAPIDCHANGE_MAX_POCKETS || tool_id > RAPIDCHANGE_MAX_TOOLS) {
+                overflow = true;
+                continue;
+            }
+
+            atc_pocket_t *entry = &pocket_table[n_pockets];
+            entry->position = calculate_pocket_pos(magazine, pocket);
+            entry->position.x += pocket_correction[n_pockets].x;
+            entry->position.y += pocket_correction[n_pockets].y;
+            entry->position.z = pocket_correction[n_pockets].z;
+            if(atc.load[idx].axis != Z_AXIS)
+                entry->position.z += atc.load[idx].z_pocket_1;
+            entry->tool_id = tool_id;
+            entry->magazine = idx;
+            n_pockets++;
+        }
+    }
+
+    if(atc.dynamic_pockets)
+        apply_pocket_map();
+
+    if(occupancy.n_pockets != n_pockets) {
+        memset(&occupancy, 0, sizeof(atc_occupancy_t));
+        occupancy.n_pockets = n_pockets;
+        store_save(Store_Occupancy);
+    }
+
+    build_tool_index();
+
+    if(overflow)
+        protocol_enqueue_foreground_task(report_warning, "RapidChange: Too many pockets or tool numbers too high, some pockets are not used!");
+}
+
 static coord_data_t get_manual_pos (void) {
     coord_data_t target = {0};
     memset(&target, 0, sizeof(coord_data_t)); // Zero plan_data struct
@@ -416,504 +1619,2283 @@ static coord_data_t get_manual_pos (void) {
     return target;
 }
 
+static float xy_distance (coord_data_t *a, coord_data_t *b) {
+    float dx = b->x - a->x;
+    float dy = b->y - a->y;
+
+    return sqrtf(dx * dx + dy * dy);
+}
+
+// Check if the pocket is known to be occupied or empty.
+static bool pocket_known (uint8_t pocket, bool occupied) {
+    uint8_t mask = bit(pocket & 7);
+
+    return pocket < n_pockets && (occupancy.known[pocket >> 3] & mask) && !(occupancy.occupied[pocket >> 3] & mask) == !occupied;
+}
+
+static void occupancy_set (uint8_t pocket, bool known, bool occupied) {
+    if(pocket >= n_pockets)
+        return;
+
+    uint8_t mask = bit(pocket & 7), known_bits = occupancy.known[pocket >> 3], occupied_bits = occupancy.occupied[pocket >> 3];
+
+    occupancy.known[pocket >> 3] = known ? known_bits | mask : known_bits & ~mask;
+    occupancy.occupied[pocket >> 3] = known && occupied ? occupied_bits | mask : occupied_bits & ~mask;
+
+    if(occupancy.known[pocket >> 3] != known_bits || occupancy.occupied[pocket >> 3] != occupied_bits)
+        store_save(Store_Occupancy);
+}
+
 static bool tool_has_pocket (tool_id_t tool_id) {
-    return tool_id != 0 && tool_id <= atc.number_of_pockets;
+    return tool_id != 0 && tool_id <= RAPIDCHANGE_MAX_TOOLS && tool_pocket[tool_id - 1] != RAPIDCHANGE_NO_POCKET;
 }
 
-static coord_data_t get_tool_pos (tool_id_t tool_id) {
-    if(tool_has_pocket(tool_id)) {
-        return calculate_tool_pos(tool_id);
-    } else
-        return get_manual_pos();
+// Get the pocket of the tool, a tool held by more than one pocket is taken from the pocket nearest
+// to the given position or from the pocket of the first magazine without position.
+static uint8_t get_tool_pocket (tool_id_t tool_id, coord_data_t *from) {
+    if(!tool_has_pocket(tool_id))
+        return RAPIDCHANGE_NO_POCKET;
+
+    uint8_t pocket = tool_pocket[tool_id - 1], nearest = pocket;
+
+    if(from && pocket_table[pocket].next != RAPIDCHANGE_NO_POCKET) {
+        float distance, min = xy_distance(from, &pocket_table[pocket].position);
+        while((pocket = pocket_table[pocket].next) != RAPIDCHANGE_NO_POCKET) {
+            if((distance = xy_distance(from, &pocket_table[pocket].position)) < min) {
+                min = distance;
+                nearest = pocket;
+            }
+        }
+    }
+
+    return nearest;
 }
 
-static bool rapid_to_tool_setter_xy() {
-    plan_line_data_t plan_data;
-    plan_data_init(&plan_data);
-    plan_data.condition.rapid_motion = On;
-    target.x = atc.tool_setter_x;
-    target.y = atc.tool_setter_y;
-    if(!mc_line(target.values, &plan_data))
+// Get the empty pocket with the shortest traverse from the given position to the load pocket.
+static uint8_t get_free_pocket (coord_data_t *from, atc_pocket_plan_t *load) {
+    uint8_t pocket = RAPIDCHANGE_NO_POCKET;
+    float distance, min = 0.0f;
+
+    for(uint_fast8_t idx = 0; idx < n_pockets; idx++) {
+        if(pocket_table[idx].tool_id != 0 || (atc.occupancy_check && pocket_known(idx, true)))
+            continue;
+        distance = xy_distance(from, &pocket_table[idx].position);
+        if(load->has_pocket)
+            distance += xy_distance(&pocket_table[idx].position, &load->position);
+        if(pocket == RAPIDCHANGE_NO_POCKET || distance < min) {
+            min = distance;
+            pocket = idx;
+        }
+    }
+
+    return pocket;
+}
+
+// Update the tool held by the pocket if the pockets are assigned dynamically.
+static void pocket_map_set (atc_pocket_plan_t *pocket, tool_id_t tool_id) {
+    if(!atc.dynamic_pockets || !pocket->has_pocket)
+        return;
+
+    RAPIDCHANGE_LOG_DEBUG("Pocket %u holds tool %lu.", pocket->pocket + 1, (unsigned long)tool_id);
+    pocket_table[pocket->pocket].tool_id = tool_id;
+    pocket_map.tool[pocket->pocket] = tool_id;
+    pocket_map_save();
+    build_tool_index();
+}
+
+static atc_tlo_cache_t *get_tlo_cache (tool_id_t tool_id) {
+    return tool_has_pocket(tool_id) ? &tlo_cache.tool[tool_id - 1] : NULL;
+}
+
+// Check if the stored tool length can be used without measuring.
+static bool tlo_cache_is_trusted (atc_tlo_cache_t *cache) {
+    if(!atc.tlo_cache || cache == NULL || !cache->valid)
+        return false;
+
+    // Stored trigger positions are relative to the reference of this session
+    if(!(sys.tlo_reference_set.mask & bit(Z_AXIS)))
+        return false;
+
+    if(atc.tlo_cache_max_age && (uint16_t)(tlo_cache.changes - cache->measured_at) >= atc.tlo_cache_max_age)
         return false;
 
+    return !atc.tlo_cache_max_uses || cache->uses < atc.tlo_cache_max_uses;
+}
+
+// Pocket Z positions are corrected by the Z correction of the pocket.
+// Engage auto tune, the outcome of each engage confirmed by the tool recognition moves the level of the engage.
+static bool tune_active (void)
+{
+    return atc.engage_tune && atc.tool_recognition;
+}
+
+static float tune_value (float value, float limit, uint_fast8_t level)
+{
+    return limit > value ? value + (limit - value) * level / RAPIDCHANGE_TUNE_LEVELS : value;
+}
+
+// The feed rate is shared by both engages and only raised as far as both are reliable.
+static float engage_feed_rate (void)
+{
+    if(!tune_active())
+        return atc.engage_feed_rate;
+
+    return tune_value(atc.engage_feed_rate, atc.tune_max_feed_rate, min(tune[Engage_Load].level, tune[Engage_Unload].level));
+}
+
+static float engage_rpm (atc_spin_t direction, float rpm)
+{
+    if(!tune_active())
+        return rpm;
+
+    return tune_value(rpm, atc.tune_max_rpm, tune[direction == Spin_CCW ? Engage_Unload : Engage_Load].level);
+}
+
+// Slow down as soon as the success rate at the level is missed, try the next level after a full window meeting it.
+static void tune_record (atc_engage_t engage, bool success)
+{
+    atc_tune_t *state = &tune[engage];
+
+    state->engages++;
+    state->samples++;
+    if(success)
+        state->successes++;
+    else
+        state->failures++;
+
+    if((uint32_t)state->successes * 100 < (uint32_t)atc.tune_success_rate * state->samples) {
+        state->level = state->level > RAPIDCHANGE_TUNE_BACKOFF ? state->level - RAPIDCHANGE_TUNE_BACKOFF : 0;
+        state->samples = state->successes = 0;
+        RAPIDCHANGE_LOG_INFO("Auto tune %s slowed down to level %u.", engage == Engage_Load ? "load" : "unload", state->level);
+    } else if(state->samples >= RAPIDCHANGE_TUNE_WINDOW) {
+        if(state->level < RAPIDCHANGE_TUNE_LEVELS) {
+            state->level++;
+            RAPIDCHANGE_LOG_INFO("Auto tune %s raised to level %u.", engage == Engage_Load ? "load" : "unload", state->level);
+        }
+        state->samples = state->successes = 0;
+    }
+
+    tune_save();
+}
+
+static uint_fast8_t pocket_axis (atc_pocket_plan_t *pocket) {
+    return pocket->has_pocket ? atc.load[pocket_table[pocket->pocket].magazine].axis : Z_AXIS;
+}
+
+// The positions of the sequence are Z positions of a magazine loaded from above, taken along the load axis of the pocket
+// from the pocket position or the pocket 1 position of the magazine and mirrored for a positive load direction.
+static float pocket_position (atc_pocket_plan_t *pocket, float position, bool corrected) {
+    if(!pocket->has_pocket)
+        return position;
+
+    uint_fast8_t magazine = pocket_table[pocket->pocket].magazine;
+    atc_load_axis_t *load = &atc.load[magazine];
+    float origin = 0.0f;
+
+    if(corrected)
+        origin = pocket->position.values[load->axis];
+    else if(load->axis == X_AXIS)
+        origin = atc.magazine[magazine].x_pocket_1;
+    else if(load->axis == Y_AXIS)
+        origin = atc.magazine[magazine].y_pocket_1;
+
+    return origin + (load->direction ? position : -position);
+}
+
+// Set the pocket position of the linear axes but the load axis, the Z position of a pocket loaded along Z is its correction.
+static void pocket_target (coord_data_t *to, coord_data_t *position, uint_fast8_t axis) {
+    for(uint_fast8_t idx = X_AXIS; idx <= Z_AXIS; idx++) {
+        if(idx != axis)
+            to->values[idx] = position->values[idx];
+    }
+}
+
+// Side loaded magazines have to be left along the load axis before moving to Z Safe Clearance.
+static bool side_loading (void) {
+    for(uint_fast8_t idx = 0; idx < RAPIDCHANGE_MAGAZINES; idx++) {
+        if(atc.magazine[idx].number_of_pockets && atc.load[idx].axis != Z_AXIS)
+            return true;
+    }
+
+    return false;
+}
+
+static void plan_pocket (atc_pocket_plan_t *pocket, tool_id_t tool_id, uint8_t pocket_id) {
+    pocket->tool_id = tool_id;
+    pocket->pocket = pocket_id;
+    pocket->has_pocket = pocket_id != RAPIDCHANGE_NO_POCKET;
+    pocket->position = pocket->has_pocket ? pocket_table[pocket_id].position : get_manual_pos();
+}
+
+// Plan the tool change from the current to the next tool from the given position. Called on tool select
+// without position, so the plan is prepared ahead of the tool change if the tool is selected before M6.
+// A choice by the distance from the position, the empty pocket for a tool without pocket and the nearest
+// pocket of a tool with several pockets if not unloading to a pocket, is left to the plan at M6 then.
+static void plan_tool_change (atc_change_plan_t *plan, tool_id_t unload_tool_id, tool_id_t load_tool_id, coord_data_t *position) {
+    uint8_t unload_pocket = spindle_pocket;
+
+    plan->valid = false;
+
+    if(atc.dynamic_pockets && unload_tool_id != 0 && !tool_has_pocket(unload_tool_id)) {
+        // The pocket of the tool is emptied on load, pick the empty pocket closest to the way to the load pocket
+        if(position == NULL)
+            return;
+        plan_pocket(&plan->load, load_tool_id, get_tool_pocket(load_tool_id, position));
+        plan_pocket(&plan->unload, unload_tool_id, get_free_pocket(position, &plan->load));
+    } else {
+        // Return the tool to the pocket it was loaded from
+        if(unload_pocket == RAPIDCHANGE_NO_POCKET || pocket_table[unload_pocket].tool_id != unload_tool_id)
+            unload_pocket = get_tool_pocket(unload_tool_id, NULL);
+        plan_pocket(&plan->unload, unload_tool_id, unload_pocket);
+
+        if(!plan->unload.has_pocket && position == NULL && tool_has_pocket(load_tool_id) &&
+            pocket_table[tool_pocket[load_tool_id - 1]].next != RAPIDCHANGE_NO_POCKET)
+            return;
+        plan_pocket(&plan->load, load_tool_id, get_tool_pocket(load_tool_id, plan->unload.has_pocket ? &plan->unload.position : position));
+    }
+
+    plan->same_magazine = plan->unload.has_pocket && plan->load.has_pocket &&
+                           pocket_table[plan->unload.pocket].magazine == pocket_table[plan->load.pocket].magazine;
+
+    // Keep traverse height till one pocket distance before the load pocket for the direct traverse
+    plan->traverse_via = false;
+    if(plan->same_magazine) {
+        float pocket_offset = atc.magazine[pocket_table[plan->load.pocket].magazine].pocket_offset;
+        float distance = xy_distance(&plan->unload.position, &plan->load.position);
+
+        if(distance > pocket_offset) {
+            float traverse = (distance - pocket_offset) / distance;
+            plan->via = plan->unload.position;
+            plan->via.x += (plan->load.position.x - plan->unload.position.x) * traverse;
+            plan->via.y += (plan->load.position.y - plan->unload.position.y) * traverse;
+            plan->traverse_via = true;
+        }
+    }
+
+    atc_tlo_cache_t *cache = get_tlo_cache(load_tool_id);
+
+    plan->probe_start = atc.tool_setter_z_seek_start;
+    if(!atc.tool_setter || load_tool_id == 0)
+        plan->set_tool = SetTool_None;
+    else if(tlo_cache_is_trusted(cache))
+        plan->set_tool = SetTool_StoredOffset;
+    else if(atc.tool_setter_fast_reprobe && cache && cache->valid) {
+        plan->set_tool = SetTool_Reprobe;
+        plan->probe_start = (float)cache->probe_z / settings.axis[Z_AXIS].steps_per_mm + atc.tool_setter_reprobe_clearance;
+        if(plan->probe_start > atc.tool_setter_z_seek_start)
+            plan->probe_start = atc.tool_setter_z_seek_start;
+    } else
+        plan->set_tool = SetTool_Probe;
+
+    plan->valid = true;
+}
+
+// Wait till all queued motion is executed, a barrier of the planned sequence.
+static bool sync_motion (void) {
+    if(timing.phase != Phase_Idle)
+        timing.current.barriers[timing.phase]++;
+
     return protocol_buffer_synchronize();
 }
 
-static bool rapid_to_pocket_xy(tool_id_t tool_id) {
+// Complete the move unless it can be blended with the next move of a planned sequence.
+static bool complete_move (void) {
+    if(atc.planned_sequence)
+        return !ABORTED;
+
+    return sync_motion();
+}
+
+// Queue the retract to safe clearance, the traverse to the given XY position and the descent to the given Z position
+// without waiting for completion.
+static bool rapid_to_position(float x, float y, float z) {
     plan_line_data_t plan_data;
     plan_data_init(&plan_data);
     plan_data.condition.rapid_motion = On;
-    coord_data_t tool = get_tool_pos(tool_id);
-    target.x = tool.x;
-    target.y = tool.y;
+
+    if(target.z < atc.z_safe_clearance) {
+        target.z = atc.z_safe_clearance;
+        if(!mc_line(target.values, &plan_data))
+            return false;
+    }
+
+    target.x = x;
+    target.y = y;
+    // All obstacles are cleared above the safe clearance, so a position above is approached directly
+    if(z >= atc.z_safe_clearance)
+        target.z = z;
     if(!mc_line(target.values, &plan_data))
         return false;
 
-    return protocol_buffer_synchronize();
+    if(target.z != z) {
+        target.z = z;
+        if(!mc_line(target.values, &plan_data))
+            return false;
+    }
+
+    return !ABORTED;
 }
 
-static bool rapid_to_z(float position) {
+// The motion is synchronized at the probe start.
+static bool rapid_to_tool_setter(float z_start) {
+    return rapid_to_position(atc.tool_setter_x, atc.tool_setter_y, z_start);
+}
+
+// Move to the pocket on all axes but the load axis, a side loaded pocket is approached at the traverse position.
+static bool rapid_to_pocket_xy(atc_pocket_plan_t *pocket) {
+    uint_fast8_t axis = pocket_axis(pocket);
     plan_line_data_t plan_data;
     plan_data_init(&plan_data);
     plan_data.condition.rapid_motion = On;
-    target.z = position;
+
+    if(axis != Z_AXIS) {
+        target.values[axis] = pocket_position(pocket, atc.z_traverse, false);
+        if(!mc_line(target.values, &plan_data))
+            return false;
+    }
+
+    pocket_target(&target, &pocket->position, axis);
     if(!mc_line(target.values, &plan_data))
         return false;
 
-    return protocol_buffer_synchronize();
+    return complete_move();
 }
 
-static bool linear_to_z(float position, float feed_rate) {
+// Move from the unload pocket at traverse height to the start position of the load pocket.
+// Pockets up to one pocket distance apart are approached diagonally, otherwise the traverse height is kept
+// till one pocket distance before the load pocket.
+static bool rapid_pocket_to_pocket(atc_change_plan_t *plan) {
+    uint_fast8_t axis = pocket_axis(&plan->load);
     plan_line_data_t plan_data;
     plan_data_init(&plan_data);
-    target.z = position;
-    plan_data.feed_rate = feed_rate;
+    plan_data.condition.rapid_motion = On;
+
+    if(plan->traverse_via) {
+        pocket_target(&target, &plan->via, axis);
+        if(!mc_line(target.values, &plan_data))
+            return false;
+    }
+
+    pocket_target(&target, &plan->load.position, axis);
+    target.values[axis] = pocket_position(&plan->load, atc.z_engage + atc.z_start, true);
     if(!mc_line(target.values, &plan_data))
         return false;
 
-    // Do not execute (buffer sync) to not introduce delay
-    return true;
+    return complete_move();
 }
 
-static void spin_cw(float speed) {
+// Queue the move of one axis without waiting for completion, regardless of the planned sequence mode.
+// Feed rate 0 is a rapid.
+static bool move_on_axis(uint_fast8_t axis, float position, float feed_rate) {
     plan_line_data_t plan_data;
     plan_data_init(&plan_data);
-    plan_data.spindle.hal->set_state(plan_data.spindle.hal, (spindle_state_t){ .on = On}, speed);
-    hal.delay_ms(atc.spindle_ramp_time, NULL);
+    if(feed_rate > 0.0f)
+        plan_data.feed_rate = feed_rate;
+    else
+        plan_data.condition.rapid_motion = On;
+    target.values[axis] = position;
+
+    return mc_line(target.values, &plan_data);
 }
 
-static void spin_ccw(float speed) {
-    plan_line_data_t plan_data;
-    plan_data_init(&plan_data);
-    plan_data.spindle.hal->set_state(plan_data.spindle.hal, (spindle_state_t){ .on = On, .ccw = On }, speed);
-    hal.delay_ms(atc.spindle_ramp_time, NULL);
+static bool rapid_on_axis(uint_fast8_t axis, float position) {
+    if(!move_on_axis(axis, position, 0.0f))
+        return false;
+
+    return complete_move();
 }
 
-static void spin_stop() {
-    plan_line_data_t plan_data;
-    plan_data_init(&plan_data);
-    plan_data.spindle.hal->set_state(plan_data.spindle.hal, (spindle_state_t){0}, 0.0f);
-    hal.delay_ms(atc.spindle_ramp_time, NULL);
+static bool rapid_to_z(float position) {
+    return rapid_on_axis(Z_AXIS, position);
 }
 
-bool spindle_has_tool() {
-    return hal.port.wait_on_input(Port_Digital, ports.tool_recognition, WaitMode_Immediate, 0.0f) > 0;
+// A ramp-down wait time of 0 takes the ramp-up wait time.
+static uint16_t ramp_down_time (void) {
+    return atc.spindle_ramp_down_time ? atc.spindle_ramp_down_time : atc.spindle_ramp_time;
 }
 
-static void message_start() {
-    char tool_msg[20];
-    sprintf(tool_msg, "Current tool: %lu", current_tool.tool_id);
-    RAPIDCHANGE_DEBUG_PRINT(tool_msg);
-    if(next_tool) {
-        sprintf(tool_msg, "Next tool: %lu", next_tool->tool_id);
-        RAPIDCHANGE_DEBUG_PRINT(tool_msg);
-    }
+static bool spindle_has_feedback (spindle_ptrs_t *spindle) {
+    return atc.spindle_feedback && ((spindle->cap.at_speed && spindle->get_state) || spindle->get_data);
 }
 
-static bool open_dust_cover_axis(bool open) {
-    plan_line_data_t plan_data;
-    plan_data_init(&plan_data);
-    plan_data.condition.rapid_motion = On;
-    target.values[atc.dust_cover_axis] = open ? atc.dust_cover_axis_open : atc.dust_cover_axis_open;
-    if(!mc_line(target.values, &plan_data))
+// Check the spindle speed, a stopped spindle is checked against the tolerance of the last programmed speed.
+static bool spindle_at_speed (spindle_ptrs_t *spindle, float rpm, float last_rpm) {
+    // The at speed signal is not reliable for a stopped spindle, use RPM feedback only
+    if(rpm > 0.0f && spindle->cap.at_speed && spindle->get_state)
+        return spindle->get_state(spindle).at_speed;
+
+    if(spindle->get_data == NULL)
         return false;
 
-    return protocol_buffer_synchronize();
+    float tolerance = settings.spindle.at_speed_tolerance > 0.0f ? settings.spindle.at_speed_tolerance : 10.0f;
+    float actual = spindle->get_data(SpindleData_RPM)->rpm;
+
+    if(rpm == 0.0f)
+        return actual <= last_rpm * tolerance / 100.0f;
+
+    return fabsf(actual - rpm) <= rpm * tolerance / 100.0f;
 }
 
+static bool motion_running (void) {
+    protocol_auto_cycle_start();
 
-static void open_dust_cover_output(bool open) {
-    hal.port.digital_out(ports.dust_cover, open);
-    // Wait till motion completed
-    hal.delay_ms(1000, NULL);
+    return plan_get_current_block() != NULL || state_get() == STATE_CYCLE;
 }
 
-static bool open_dust_cover(bool open) {
-    if(atc.dust_cover == DustCover_Disabled) {
-        return true;
-    }
+// Wait till the spindle reaches the given speed, the wait time is replaced by the feedback timeout
+// if feedback is available. The foreground loop is serviced meanwhile.
+static bool spindle_wait (spindle_ptrs_t *spindle, float rpm, float last_rpm, uint16_t wait_time, bool feedback) {
+    uint32_t started = hal.get_elapsed_ticks();
 
-    if(open) {
-        RAPIDCHANGE_DEBUG_PRINT("Open dust cover.");
-    } else {
-        RAPIDCHANGE_DEBUG_PRINT("Close dust cover.");
-    }
+    if((feedback = feedback && spindle_has_feedback(spindle)))
+        wait_time = RAPIDCHANGE_SPINDLE_TIMEOUT;
 
-    if(atc.dust_cover == DustCover_UsePort) {
-        open_dust_cover_output(open);
-        return true;
-    } else {
-        return open_dust_cover_axis(open);
+    while(!(feedback && spindle_at_speed(spindle, rpm, last_rpm))) {
+        if(hal.get_elapsed_ticks() - started >= wait_time) {
+            if(feedback) {
+                RAPIDCHANGE_LOG_WARNING("Spindle feedback timed out.");
+            }
+            break;
+        }
+        if(!protocol_execute_realtime())
+            return false;
     }
-}
 
-void record_program_state() {
-    RAPIDCHANGE_DEBUG_PRINT("Record program state.");
-    // Spindle off and coolant off
-    RAPIDCHANGE_DEBUG_PRINT("Turning off spindle");
-    spindle_all_off();
-    RAPIDCHANGE_DEBUG_PRINT("Turning off coolant");
-    hal.coolant.set_state((coolant_state_t){0});
-    // Save current position.
-    system_convert_array_steps_to_mpos(previous.values, sys.position);
-    // Establish axis assignments.
-    previous.z -= gc_get_offset(Z_AXIS);
-    // Store current position as start
-    memcpy(&target, &previous, sizeof(coord_data_t));
+    return !ABORTED;
 }
 
-// Restore coolant and spindle status, return controlled point to original position.
-static bool restore (void)
-{
+// Queue the moves of the plunge ahead of the current position so the planner keeps the feed rate, the moves queued
+// cover at least the distance to stop from the feed rate. Up to one more move is queued, so the plunge travels
+// at most the distance to stop plus one move once the nut seats.
+static bool engage_next (atc_plunge_t *plunge) {
+    float position = sys.position[plunge->axis] / settings.axis[plunge->axis].steps_per_mm;
+    float feed_rate = engage_feed_rate();
+    float lookahead = feed_rate * feed_rate / (2.0f * settings.axis[plunge->axis].acceleration);
+
+    while(plunge->queued != plunge->position && fabsf(plunge->queued - position) < lookahead) {
+        float remaining = plunge->position - plunge->queued;
+
+        plunge->queued = fabsf(remaining) > RAPIDCHANGE_ENGAGE_SEGMENT
+                          ? plunge->queued + copysignf(RAPIDCHANGE_ENGAGE_SEGMENT, remaining)
+                          : plunge->position;
+
+        if(!move_on_axis(plunge->axis, plunge->queued, feed_rate))
+            return false;
+    }
+
+    return true;
+}
+
+// Plunge to engage the clamping nut. With seat detection the plunge is queued in short moves while the
+// spindle speed is sampled, the moves are no longer queued once the nut seats so the plunge ends without
+// cancelling motion. A nut seating before the seat window is cross-threaded. The spindle has to run at
+// speed when starting the plunge.
+static bool engage (uint_fast8_t axis, float position) {
+    atc_plunge_t plunge = { .axis = axis, .position = position, .queued = target.values[axis] };
+    plan_line_data_t plan_data;
+    plan_data_init(&plan_data);
+
+    run.sensed.seated = false;
+    run.sensed.threaded = true;
+
+    float rpm = atc.seat_detection && plan_data.spindle.hal->get_data ? plan_data.spindle.hal->get_data(SpindleData_RPM)->rpm : 0.0f;
+
+    if(rpm <= 0.0f)
+        return move_on_axis(axis, position, engage_feed_rate());
+
+    rpm = rpm * (100.0f - atc.seat_rpm_drop) / 100.0f;
+
+    do {
+        if(plan_data.spindle.hal->get_data(SpindleData_RPM)->rpm <= rpm) {
+            float seated = sys.position[axis] / settings.axis[axis].steps_per_mm;
+
+            run.sensed.seated = true;
+            run.sensed.threaded = fabsf(position - seated) <= atc.seat_window;
+            RAPIDCHANGE_LOG_DEBUG("Nut seated %s before the engage position.", ftoa(fabsf(position - seated), 3));
+            break;
+        }
+        if(!engage_next(&plunge) || !protocol_execute_realtime())
+            return false;
+    } while(plunge.queued != position || motion_running());
+
+    return !ABORTED;
+}
+
+// The spindle state is changed immediately, so all moves before have to be completed.
+// The ramp is waited for before the next step.
+static bool spin (spindle_state_t state, float speed) {
+    if(!sync_motion())
+        return false;
+
+    bool was_on = spindle_state.on;
+    plan_line_data_t plan_data;
+    plan_data_init(&plan_data);
+    plan_data.spindle.hal->set_state(plan_data.spindle.hal, state, speed);
+    spindle_state = state;
+
+    if(state.on) {
+        spindle_speed = speed;
+        return spindle_wait(plan_data.spindle.hal, speed, spindle_speed, atc.spindle_ramp_time, true);
+    }
+
+    // A stopped spindle needs no ramp-down wait
+    return !was_on || spindle_wait(plan_data.spindle.hal, 0.0f, spindle_speed, ramp_down_time(), true);
+}
+
+static bool spin_stop() {
+    return spin((spindle_state_t){0}, 0.0f);
+}
+
+// Start the spindle without waiting, the ramp time is waited for by spin_wait() before the engage.
+// A running spindle in the other direction is reversed directly if the spindle allows it, otherwise
+// stopped first.
+static bool spin_start (spindle_state_t state, float speed) {
+    if(!sync_motion())
+        return false;
+
+    run.spin_ramp_time = atc.spindle_ramp_time;
+    run.spin_reversing = false;
+    if(spindle_state.on && spindle_state.ccw != state.ccw) {
+        if((run.spin_reversing = atc.spindle_reversal_time != 0))
+            run.spin_ramp_time = atc.spindle_reversal_time;
+        else if(!spin_stop())
+            return false;
+    }
+
     plan_line_data_t plan_data;
+    plan_data_init(&plan_data);
+    plan_data.spindle.hal->set_state(plan_data.spindle.hal, state, speed);
+    run.spin_started = hal.get_elapsed_ticks();
+    spindle_state = state;
+    spindle_speed = speed;
+
+    return true;
+}
 
+// Wait for the remaining ramp time of the spindle started by spin_start().
+static bool spin_wait (void) {
+    if(!sync_motion())
+        return false;
+
+    uint32_t elapsed = hal.get_elapsed_ticks() - run.spin_started;
+    uint16_t remaining = elapsed < run.spin_ramp_time ? run.spin_ramp_time - elapsed : 0;
+    plan_line_data_t plan_data;
+    plan_data_init(&plan_data);
+
+    // The speed feedback is not reliable while reversing
+    return spindle_wait(plan_data.spindle.hal, spindle_speed, spindle_speed, remaining, !run.spin_reversing);
+}
+
+// The sensor has to be read at the final position of the queued moves.
+bool spindle_has_tool() {
+    if(!sync_motion())
+        return false;
+
+    return hal.port.wait_on_input(Port_Digital, ports.tool_recognition, WaitMode_Immediate, 0.0f) > 0;
+}
+
+static void recognition_irq (uint8_t port, bool state) {
+    if(recognition.n_edges < RAPIDCHANGE_RECOGNITION_EDGES) {
+        recognition.edge[recognition.n_edges].position = sys.position[recognition.axis];
+        recognition.edge[recognition.n_edges].state = state;
+        recognition.n_edges++;
+    } else
+        recognition.overflow = true;
+}
+
+// Start latching the IR beam changes from the current position on the axis, returns false if not configured or supported.
+static bool recognition_arm (uint_fast8_t axis) {
+    if(!atc.tool_recognition_on_the_fly || hal.port.register_interrupt_handler == NULL)
+        return false;
+
+    // Motion towards the start position passes the zones as well
+    if(!sync_motion())
+        return false;
+
+    recognition.n_edges = 0;
+    recognition.overflow = false;
+    recognition.axis = axis;
+    recognition.start = sys.position[axis];
+
+    if(!hal.port.register_interrupt_handler(ports.tool_recognition, IRQ_Mode_Change, recognition_irq))
+        return false;
+
+    recognition.initial_state = hal.port.wait_on_input(Port_Digital, ports.tool_recognition, WaitMode_Immediate, 0.0f) > 0;
+
+    return true;
+}
+
+static void recognition_disarm (void) {
+    hal.port.register_interrupt_handler(ports.tool_recognition, IRQ_Mode_None, NULL);
+}
+
+// Get the IR beam state at the given position of the latched move.
+// Beam changes which are reverted within the debounce distance are skipped.
+static bool recognition_state_at (float position) {
+    bool state = recognition.initial_state;
+    int32_t steps = lroundf(position * settings.axis[recognition.axis].steps_per_mm);
+    int32_t debounce = lroundf(atc.tool_recognition_debounce * settings.axis[recognition.axis].steps_per_mm);
+    int32_t distance = labs(steps - recognition.start);
+    uint_fast8_t idx = 0;
+
+    while(idx < recognition.n_edges) {
+        atc_recognition_edge_t *edge = &recognition.edge[idx];
+
+        if(labs(edge->position - recognition.start) > distance)
+            break;
+
+        if(idx + 1 < recognition.n_edges && labs(recognition.edge[idx + 1].position - edge->position) <= debounce) {
+            idx += 2;
+            continue;
+        }
+
+        state = edge->state;
+        idx++;
+    }
+
+    return state;
+}
+
+// Move through recognition zone 1 and 2 of the pocket and stop the spindle, check if the tool is loaded and properly threaded.
+static bool recognize_loaded_tool (atc_pocket_plan_t *pocket, bool *loaded, bool *threaded) {
+    uint_fast8_t axis = pocket_axis(pocket);
+    float zone_1 = pocket_position(pocket, atc.tool_recognition_z_zone_1, false);
+    float zone_2 = pocket_position(pocket, atc.tool_recognition_z_zone_2, false);
+
+    *threaded = false;
+
+    if(recognition_arm(axis)) {
+        RAPIDCHANGE_LOG_DEBUG("Move through recognition zones.");
+        bool ok = move_on_axis(axis, zone_1, 0.0f) &&
+                  move_on_axis(axis, zone_2, 0.0f) &&
+                  spin_stop();
+        recognition_disarm();
+        if(!ok)
+            return false;
+
+        if(recognition.overflow) {
+            RAPIDCHANGE_LOG_WARNING("Tool recognition is unreliable, too many IR beam changes.");
+            *loaded = false;
+        } else {
+            *loaded = recognition_state_at(zone_1);
+            *threaded = !recognition_state_at(zone_2);
+        }
+
+        return true;
+    }
+
+    RAPIDCHANGE_LOG_DEBUG("Move to recognition zone 1.");
+    if (!rapid_on_axis(axis, zone_1))
+        return false;
+    if(!spin_stop())
+        return false;
+
+    if((*loaded = spindle_has_tool())) {
+        RAPIDCHANGE_LOG_DEBUG("Move to recognition zone 2.");
+        if (!rapid_on_axis(axis, zone_2))
+            return false;
+        *threaded = !spindle_has_tool();
+    }
+
+    return !ABORTED;
+}
+
+// Retract from the pocket to the given position with the spindle running, the tool is dropped if the IR beam was clear at zone 1.
+static bool retract_and_sense (atc_pocket_plan_t *pocket, float position, bool *tool) {
+    uint_fast8_t axis = pocket_axis(pocket);
+    float zone_1 = pocket_position(pocket, atc.tool_recognition_z_zone_1, false);
+
+    if(!recognition_arm(axis)) {
+        if(!rapid_on_axis(axis, zone_1))
+            return false;
+        *tool = spindle_has_tool();
+        return rapid_on_axis(axis, position);
+    }
+
+    bool ok = move_on_axis(axis, position, 0.0f) && sync_motion();
+    recognition_disarm();
+    if(!ok)
+        return false;
+
+    if(recognition.overflow) {
+        RAPIDCHANGE_LOG_WARNING("Tool recognition is unreliable, too many IR beam changes.");
+    }
+
+    *tool = recognition.overflow || recognition_state_at(zone_1);
+
+    return true;
+}
+
+static void message_start() {
+    RAPIDCHANGE_LOG_INFO("Current tool: %lu", (unsigned long)current_tool.tool_id);
+    if(next_tool) {
+        RAPIDCHANGE_LOG_INFO("Next tool: %lu", (unsigned long)next_tool->tool_id);
+    }
+}
+
+// The cover axis moves along with the climb to the safe clearance, so the cover is open before any descent.
+static bool open_dust_cover_axis(bool open) {
+    plan_line_data_t plan_data;
     plan_data_init(&plan_data);
     plan_data.condition.rapid_motion = On;
+    target.values[atc.dust_cover_axis] = open ? atc.dust_cover_axis_open : atc.dust_cover_axis_close;
+    if(target.z < atc.z_safe_clearance)
+        target.z = atc.z_safe_clearance;
+
+    return mc_line(target.values, &plan_data);
+}
+
+// Start opening or closing the cover, opening is completed by dust_cover_wait().
+static bool open_dust_cover_output(bool open) {
+    // Do not close the cover while the spindle may still be in the magazine
+    if(!open && !sync_motion())
+        return false;
+
+    hal.port.digital_out(ports.dust_cover, open);
+    dust_cover_opening = open;
+    dust_cover_started = hal.get_elapsed_ticks();
+
+    return true;
+}
+
+// Wait till the dust cover is open, started right before the first descent into the magazine.
+// A cover with feedback not reported open within the port delay fails the change.
+static bool dust_cover_wait (void) {
+    bool feedback = atc.dust_cover_feedback && ports.dust_cover_feedback != 0xFF;
+
+    if(!dust_cover_opening)
+        return true;
+
+    dust_cover_opening = false;
+
+    while(!(feedback && hal.port.wait_on_input(Port_Digital, ports.dust_cover_feedback, WaitMode_Immediate, 0.0f) > 0)) {
+        if(hal.get_elapsed_ticks() - dust_cover_started >= atc.dust_cover_port_delay) {
+            if(feedback) {
+                protocol_enqueue_foreground_task(report_warning, "RapidChange: Dust cover not open.");
+                return false;
+            }
+            break;
+        }
+        if(!protocol_execute_realtime())
+            return false;
+    }
+
+    return !ABORTED;
+}
+
+static bool open_dust_cover(bool open) {
+    if(atc.dust_cover == DustCover_Disabled) {
+        return true;
+    }
+
+    if(open) {
+        RAPIDCHANGE_LOG_INFO("Open dust cover.");
+    } else {
+        RAPIDCHANGE_LOG_INFO("Close dust cover.");
+    }
+
+    if(atc.dust_cover == DustCover_UsePort) {
+        return open_dust_cover_output(open);
+    } else {
+        return open_dust_cover_axis(open);
+    }
+}
+
+void record_program_state() {
+    RAPIDCHANGE_LOG_INFO("Record program state.");
+    // Spindle off and coolant off
+    RAPIDCHANGE_LOG_DEBUG("Turning off spindle");
+    spindle_all_off();
+    spindle_state = (spindle_state_t){0};
+    RAPIDCHANGE_LOG_DEBUG("Turning off coolant");
+    hal.coolant.set_state((coolant_state_t){0});
+    // Save current position.
+    system_convert_array_steps_to_mpos(previous.values, sys.position);
+    // Establish axis assignments.
+    previous.z -= gc_get_offset(Z_AXIS);
+    // Store current position as start
+    memcpy(&target, &previous, sizeof(coord_data_t));
+}
+
+// Restore coolant and spindle status, return controlled point to original position.
+static bool restore (void)
+{
+    plan_line_data_t plan_data;
+
+    plan_data_init(&plan_data);
+    plan_data.condition.rapid_motion = On;
+
+    target.z = atc.z_safe_clearance;
+    mc_line(target.values, &plan_data);
+
+    if(!settings.flags.no_restore_position_after_M6) {
+        memcpy(&target, &previous, sizeof(coord_data_t));
+        target.z = atc.z_safe_clearance;
+        mc_line(target.values, &plan_data);
+    }
+
+    if(sync_motion()) {
+
+        sync_position();
+
+        coolant_sync(gc_state.modal.coolant);
+        spindle_restore(plan_data.spindle.hal, gc_state.modal.spindle.state, gc_state.spindle.rpm);
+
+        if(!settings.flags.no_restore_position_after_M6) {
+            previous.z += gc_get_offset(Z_AXIS);
+            mc_line(previous.values, &plan_data);
+        }
+    }
+
+    if(sync_motion()) {
+        sync_position();
+        // Already done after load tool
+        // memcpy(&current_tool, next_tool, sizeof(tool_data_t));
+    }
+
+    return !ABORTED;
+}
+
+static bool restore_program_state (void) {
+    if(current_tool.tool_id == 0) {
+        return true;
+    }
+    RAPIDCHANGE_LOG_INFO("Restore.");
+
+    // Get current position.
+    system_convert_array_steps_to_mpos(target.values, sys.position);
+
+    bool ok = restore();
+
+    return ok;
+}
+
+static void set_tool_change_state(void) {
+    RAPIDCHANGE_LOG_DEBUG("Set tool change state.");
+    sync_motion();
+    sync_position();
+}
+
+// Pause for a manual intervention with a feed hold, the change continues on cycle start.
+// A parked spindle completes the moves to the park position before the hold and rises again on cycle start,
+// the rise is queued without waiting so it is blended with the moves of the next steps.
+static bool pause (atc_message_t message) {
+    if(atc.park && !rapid_to_position(atc.park_x, atc.park_y, atc.park_z))
+        return false;
+
+    protocol_enqueue_foreground_task(report_warning, (char *)atc_messages[message]);
+    if(!sync_motion())
+        return false;
+    system_set_exec_state_flag(EXEC_FEED_HOLD); // Use feed hold for program pause.
+
+    do {
+        if(!protocol_execute_realtime())
+            return false;
+    } while(sys.suspend || (sys.rt_exec_state & EXEC_FEED_HOLD));
+
+    if(atc.park && target.z < atc.z_safe_clearance) {
+        plan_line_data_t plan_data;
+        plan_data_init(&plan_data);
+        plan_data.condition.rapid_motion = On;
+        target.z = atc.z_safe_clearance;
+        if(!mc_line(target.values, &plan_data))
+            return false;
+    }
+
+    return !ABORTED;
+}
+
+// Perform the slower locating phase only, starting at the re-probe clearance above the last trigger position.
+static bool reprobe_tool (void) {
+    plan_line_data_t plan_data;
+    gc_parser_flags_t flags = {0};
+
+    plan_data_init(&plan_data);
+    plan_data.feed_rate = atc.tool_setter_set_feed_rate;
+    // Fall back to the full probe cycle if not found
+    flags.probe_is_no_error = On;
+    target.z -= 2.0f * atc.tool_setter_reprobe_clearance;
+
+    return sync_motion() && mc_probe_cycle(target.values, &plan_data, flags) == GCProbe_Found;
+}
+
+// Full probe cycle, seek the tool setter, retract a bit and perform the slower locating phase.
+static bool probe_tool (void) {
+    // Probe cycle using GCode interface since tool change interface is private
+    plan_line_data_t plan_data;
+    gc_parser_flags_t flags = {0};
+
+    plan_data_init(&plan_data);
+    plan_data.feed_rate = atc.tool_setter_seek_feed_rate;
+    target.z -= atc.tool_setter_max_travel;
+    bool ok = sync_motion();
+    // Locate probe
+    if((ok = ok && mc_probe_cycle(target.values, &plan_data, flags) == GCProbe_Found))
+    {
+        system_convert_array_steps_to_mpos(target.values, sys.probe_position);
+
+        // Retract a bit and perform slow probe
+        target.z += atc.tool_setter_seek_retreat;
+        if((ok = mc_line(target.values, &plan_data))) {
+            plan_data.feed_rate = atc.tool_setter_set_feed_rate;
+            target.z -= (atc.tool_setter_seek_retreat + 2.0f);
+            ok = mc_probe_cycle(target.values, &plan_data, flags) == GCProbe_Found;
+        }
+    }
+
+    return ok;
+}
+
+// Repeat the fine probe from the touch retract above the last trigger position till the configured number of touches.
+// The median is accepted if the majority of the touches is within the touch tolerance of it.
+static bool touch_tool (int32_t *probe_z, bool *accepted) {
+    plan_line_data_t plan_data;
+    gc_parser_flags_t flags = {0};
+    int32_t touch[RAPIDCHANGE_MAX_TOUCHES], tolerance = lroundf(atc.tool_setter_touch_tolerance * settings.axis[Z_AXIS].steps_per_mm);
+    uint_fast8_t idx, n_touches = 1, inliers = 0;
+
+    touch[0] = sys.probe_position[Z_AXIS];
+    plan_data_init(&plan_data);
+
+    while(n_touches < min(atc.tool_setter_touches, RAPIDCHANGE_MAX_TOUCHES)) {
+        system_convert_array_steps_to_mpos(target.values, sys.probe_position);
+        plan_data.feed_rate = atc.tool_setter_seek_feed_rate;
+        target.z += atc.tool_setter_touch_retract;
+        if(!mc_line(target.values, &plan_data))
+            return false;
+
+        plan_data.feed_rate = atc.tool_setter_set_feed_rate;
+        target.z -= atc.tool_setter_touch_retract + 2.0f;
+        if(mc_probe_cycle(target.values, &plan_data, flags) != GCProbe_Found)
+            return false;
+
+        // Insertion sort of the touches
+        for(idx = n_touches++; idx > 0 && touch[idx - 1] > sys.probe_position[Z_AXIS]; idx--)
+            touch[idx] = touch[idx - 1];
+        touch[idx] = sys.probe_position[Z_AXIS];
+    }
+
+    *probe_z = touch[n_touches / 2];
+    for(idx = 0; idx < n_touches; idx++) {
+        if(labs(touch[idx] - *probe_z) <= tolerance)
+            inliers++;
+    }
+    *accepted = inliers > n_touches / 2;
+
+    if(n_touches > 1 && !*accepted) {
+        RAPIDCHANGE_LOG_WARNING("Tool setter touches spread too much.");
+    }
+
+    return true;
+}
+
+static bool set_tool (void) {
+    // If the tool setter is disabled or if we don't have a tool, rise up and be done
+    if(change_plan.set_tool == SetTool_None || current_tool.tool_id == 0) {
+        if(!rapid_to_z(atc.z_safe_clearance))
+            return false;
+        return true;
+    }
+
+    atc_tlo_cache_t *cache = get_tlo_cache(current_tool.tool_id);
+
+    if(change_plan.set_tool == SetTool_StoredOffset) {
+        RAPIDCHANGE_LOG_INFO("Set stored TLO.");
+        gc_set_tool_offset(ToolLengthOffset_EnableDynamic, Z_AXIS, cache->probe_z - sys.tlo_reference[Z_AXIS]);
+        if(cache->uses < UINT8_MAX)
+            cache->uses++;
+        return rapid_to_z(atc.z_safe_clearance);
+    }
+
+    RAPIDCHANGE_LOG_INFO("Set tool length.");
+    bool ok = false, reprobe = change_plan.set_tool == SetTool_Reprobe;
+
+    RAPIDCHANGE_LOG_DEBUG("Move to probe.");
+    if(!rapid_to_tool_setter(change_plan.probe_start))
+        return false;
+
+    if(reprobe) {
+        RAPIDCHANGE_LOG_DEBUG("Re-probe cycle.");
+        if(!(ok = reprobe_tool())) {
+            if(ABORTED)
+                return false;
+            RAPIDCHANGE_LOG_WARNING("Tool setter not found at last tool length, perform full probe cycle.");
+            if(!rapid_to_z(atc.tool_setter_z_seek_start))
+                return false;
+        }
+    }
+
+    if(!ok) {
+        RAPIDCHANGE_LOG_DEBUG("Probe cycle.");
+        ok = probe_tool();
+    }
+
+    // Probe again till the touches agree, a deviation from the stored tool length has to be confirmed by the next measurement
+    int32_t probe_z = 0, deviating = 0, tolerance = lroundf(atc.tool_setter_cache_tolerance * settings.axis[Z_AXIS].steps_per_mm);
+    bool accepted, confirm = false;
+    uint_fast8_t attempt = 0;
+
+    while(ok && (ok = touch_tool(&probe_z, &accepted))) {
+        if(accepted && tolerance > 0 && cache && cache->valid && labs(probe_z - cache->probe_z) > tolerance) {
+            RAPIDCHANGE_LOG_WARNING("Tool length deviates from the stored length.");
+            accepted = confirm && labs(probe_z - deviating) <= tolerance;
+            deviating = probe_z;
+            confirm = true;
+        }
+
+        if(accepted)
+            break;
+
+        if(++attempt == RAPIDCHANGE_PROBE_ATTEMPTS) {
+            protocol_enqueue_foreground_task(report_warning, "RapidChange: Tool length measurements do not agree, check the tool setter!");
+            return false;
+        }
+
+        RAPIDCHANGE_LOG_WARNING("Tool length rejected, probe again.");
+        ok = rapid_to_z(atc.tool_setter_z_seek_start) && probe_tool();
+    }
+
+    if(ok) {
+        if(cache) {
+            cache->probe_z = probe_z;
+            cache->measured_at = tlo_cache.changes;
+            cache->uses = 0;
+            cache->valid = true;
+        }
+
+        if(!(sys.tlo_reference_set.mask & bit(Z_AXIS))) {
+            RAPIDCHANGE_LOG_INFO("Set TLO reference.");
+            sys.tlo_reference[Z_AXIS] = probe_z;
+            sys.tlo_reference_set.mask |= bit(Z_AXIS);
+            system_add_rt_report(Report_TLOReference);
+            grbl.report.feedback_message(Message_ReferenceTLOEstablished);
+        } else {
+            RAPIDCHANGE_LOG_INFO("Set TLO.");
+            gc_set_tool_offset(ToolLengthOffset_EnableDynamic, Z_AXIS, probe_z - sys.tlo_reference[Z_AXIS]);
+        }
+    }
+
+    RAPIDCHANGE_LOG_DEBUG("End of probing.");
+    if(ok)
+      if(!rapid_to_z(atc.z_safe_clearance))
+        return false;
+
+    return ok;
+}
+
+// Start timing of the given tool change phase and end timing of the previous one.
+static void phase_start (atc_phase_t phase)
+{
+    uint32_t now = hal.get_elapsed_ticks();
+
+    if(timing.phase != Phase_Idle)
+        timing.current.duration[timing.phase] += now - timing.phase_start;
+    else
+        timing.started = now;
+
+    timing.phase = phase;
+    timing.phase_start = now;
+}
+
+static uint32_t phase_duration (atc_phase_times_t *times, atc_phase_t phase)
+{
+    uint32_t duration = 0;
+
+    if(phase != Phase_Idle)
+        return times->duration[phase];
+
+    // Phase_Idle is used for the total of all phases
+    for(phase = Phase_RecordState; phase < Phase_Idle; phase++)
+        duration += times->duration[phase];
+
+    return duration;
+}
+
+// Add the timing of the finished tool change to the history.
+static void record_timing (void)
+{
+    memcpy(&timing.history[timing.head], &timing.current, sizeof(atc_phase_times_t));
+    timing.head = (timing.head + 1) % RAPIDCHANGE_TIMING_HISTORY;
+    if(timing.count < RAPIDCHANGE_TIMING_HISTORY)
+        timing.count++;
+
+    RAPIDCHANGE_LOG_INFO("Tool change time: %lu ms", (unsigned long)phase_duration(&timing.current, Phase_Idle));
+}
+
+// Report last, min, mean and max time (ms) and the syncs of the last tool change per phase.
+static void report_phase_timing (atc_phase_t phase)
+{
+    uint32_t last, min = UINT32_MAX, max = 0, sum = 0, duration;
+    uint16_t barriers = 0;
+    atc_phase_times_t *times = &timing.history[(timing.head + RAPIDCHANGE_TIMING_HISTORY - 1) % RAPIDCHANGE_TIMING_HISTORY];
+
+    last = phase_duration(times, phase);
+    if(phase != Phase_Idle)
+        barriers = times->barriers[phase];
+    else for(atc_phase_t idx = Phase_RecordState; idx < Phase_Idle; idx++)
+        barriers += times->barriers[idx];
+
+    for(uint_fast8_t idx = 0; idx < timing.count; idx++) {
+        duration = phase_duration(&timing.history[idx], phase);
+        sum += duration;
+        if(duration < min)
+            min = duration;
+        if(duration > max)
+            max = duration;
+    }
+
+    hal.stream.write("[RCTIME:");
+    hal.stream.write(phase == Phase_Idle ? "Total" : atc_phase_names[phase]);
+    hal.stream.write("|");
+    hal.stream.write(uitoa(last));
+    hal.stream.write("|");
+    hal.stream.write(uitoa(min));
+    hal.stream.write("|");
+    hal.stream.write(uitoa(sum / timing.count));
+    hal.stream.write("|");
+    hal.stream.write(uitoa(max));
+    hal.stream.write("|");
+    hal.stream.write(uitoa(barriers));
+    hal.stream.write("]" ASCII_EOL);
+}
+
+static status_code_t report_timing (sys_state_t state, char *args)
+{
+    if(timing.count == 0) {
+        hal.stream.write("[RCTIME:No tool change recorded]" ASCII_EOL);
+        return Status_OK;
+    }
+
+    for(atc_phase_t phase = Phase_RecordState; phase <= Phase_Idle; phase++)
+        report_phase_timing(phase);
+
+    hal.stream.write("[RCTIME:NVS writes|");
+    hal.stream.write(uitoa(store_writes));
+    hal.stream.write("]" ASCII_EOL);
+
+    return Status_OK;
+}
+
+// Tool change sequence, compiled into a table of steps when the settings are loaded.
+// The settings select the emitted steps, the tools and pockets of a change are evaluated by jump conditions.
+
+static uint_fast8_t emit (atc_opcode_t op, uint8_t arg, float value)
+{
+    if(n_steps < RAPIDCHANGE_MAX_STEPS) {
+        if(op == Step_Phase)
+            phase_step[arg] = n_steps;
+        sequence[n_steps].op = op;
+        sequence[n_steps].arg = arg;
+        sequence[n_steps].jump = 0;
+        sequence[n_steps].value = value;
+    }
+
+    return n_steps++;
+}
+
+static uint_fast8_t emit_jump (uint8_t condition)
+{
+    return emit(Step_Jump, condition, 0.0f);
+}
+
+// Jump back to a step emitted before.
+static void emit_jump_to (uint8_t condition, uint_fast8_t step)
+{
+    uint_fast8_t jump = emit_jump(condition);
+
+    if(jump < RAPIDCHANGE_MAX_STEPS)
+        sequence[jump].jump = step;
+}
+
+// Continue a jump emitted before at the next step.
+static void emit_label (uint_fast8_t jump)
+{
+    if(jump < RAPIDCHANGE_MAX_STEPS)
+        sequence[jump].jump = n_steps;
+}
+
+// Rise to the safe clearance and pause for a manual intervention, the spindle rises on its own when parking.
+static void emit_pause (atc_message_t message)
+{
+    if(!atc.park)
+        emit(Step_Rapid, Ref_Machine, atc.z_safe_clearance);
+    emit(Step_Pause, message, 0.0f);
+}
+
+static void compile_unload (void)
+{
+    uint_fast8_t done, manual, occupied = RAPIDCHANGE_MAX_STEPS, removed, dropped, stop, failed, retry;
+
+    emit(Step_Phase, Phase_Unload, 0.0f);
+    emit(Step_Rapid, Ref_Machine, atc.z_safe_clearance);
+
+    // If we don't have a tool we're done
+    done = emit_jump(Cond_UnloadTool|RAPIDCHANGE_NOT);
+    manual = emit_jump(Cond_UnloadPocket|RAPIDCHANGE_NOT);
+    if(atc.occupancy_check)
+        occupied = emit_jump(Cond_UnloadPocketFree|RAPIDCHANGE_NOT);
+
+    // Perform first attempt
+    emit(Step_RapidPocket, Ref_Unload, 0.0f);
+    if(atc.dust_cover == DustCover_UsePort)
+        emit(Step_DustCoverWait, 0, 0.0f);
+    emit(Step_Rapid, Ref_Unload, atc.z_engage + atc.z_start);
+    emit(Step_Spin, Spin_CCW, atc.unload_rpm);
+    retry = emit(Step_Feed, Ref_Unload, atc.z_engage);
+
+    if(atc.tool_recognition && atc.tool_recognition_on_the_fly && hal.port.register_interrupt_handler) {
+        // Sense the tool while retracting, a dropped tool goes straight on to traverse height for loading
+        emit(Step_SenseRetract, Ref_UnloadAxis, atc.z_traverse);
+        if(atc.engage_tune)
+            emit(Step_Tune, Engage_Unload, 0.0f);
+
+        // If we have a tool, try unloading again while retries are left
+        stop = emit_jump(Cond_ToolSensed|RAPIDCHANGE_NOT);
+        failed = emit_jump(Cond_UnloadRetry|RAPIDCHANGE_NOT);
+        emit(Step_Rapid, Ref_Unload, atc.z_engage + atc.z_start);
+        emit_jump_to(Cond_Always, retry);
+
+        // Otherwise rise and pause for manual unloading
+        emit_label(failed);
+        emit(Step_Spin, Spin_Stop, 0.0f);
+        emit_pause(Message_UnloadFailed);
+        removed = emit_jump(Cond_Always);
+
+        emit_label(stop);
+        if(!atc.spindle_traverse)
+            emit(Step_Spin, Spin_Stop, 0.0f);
+    } else if(atc.tool_recognition) {
+        emit(Step_Rapid, Ref_UnloadAxis, atc.tool_recognition_z_zone_1);
+        emit(Step_Sense, 0, 0.0f);
+        if(atc.engage_tune)
+            emit(Step_Tune, Engage_Unload, 0.0f);
+
+        // If we have a tool, try unloading again while retries are left
+        stop = emit_jump(Cond_ToolSensed|RAPIDCHANGE_NOT);
+        failed = emit_jump(Cond_UnloadRetry|RAPIDCHANGE_NOT);
+        emit(Step_Rapid, Ref_Unload, atc.z_engage + atc.z_start);
+        emit_jump_to(Cond_Always, retry);
+
+        // Whether successful or not, we're done trying
+        emit_label(stop);
+        emit_label(failed);
+        emit(Step_Spin, Spin_Stop, 0.0f);
+        emit(Step_Sense, 0, 0.0f);
+
+        // If we have a tool at this point, rise and pause for manual unloading
+        dropped = emit_jump(Cond_ToolSensed|RAPIDCHANGE_NOT);
+        if(side_loading())
+            emit(Step_Rapid, Ref_UnloadAxis, atc.z_traverse);
+        emit_pause(Message_UnloadFailed);
+        removed = emit_jump(Cond_Always);
+
+        // Otherwise, get ready to load
+        emit_label(dropped);
+        emit(Step_Rapid, Ref_UnloadAxis, atc.z_traverse);
+    } else {
+        // If we're not using tool recognition, go straight to traverse height for loading
+        removed = RAPIDCHANGE_MAX_STEPS;
+        emit(Step_Rapid, Ref_UnloadAxis, atc.z_traverse);
+        if(!atc.spindle_traverse)
+            emit(Step_Spin, Spin_Stop, 0.0f);
+    }
+    emit(Step_Unloaded, true, 0.0f);
+    dropped = emit_jump(Cond_Always);
+
+    // If the pocket is occupied already, pause for manual removal before moving into the magazine
+    if(atc.occupancy_check) {
+        emit_label(occupied);
+        emit(Step_Pause, Message_UnloadPocketOccupied, 0.0f);
+        occupied = emit_jump(Cond_Always);
+    }
+
+    // If the tool doesn't have a pocket, let's pause for manual removal
+    emit_label(manual);
+    emit(Step_Pause, Message_UnloadNoPocket, 0.0f);
+    emit_label(removed);
+    emit_label(occupied);
+    emit(Step_Unloaded, false, 0.0f);
+
+    emit_label(dropped);
+    emit_label(done);
+}
+
+static void compile_load (void)
+{
+    uint_fast8_t none, manual, empty = RAPIDCHANGE_MAX_STEPS, pocket, engage = RAPIDCHANGE_MAX_STEPS, done, recognized, threaded, seated;
+
+    emit(Step_Phase, Phase_Load, 0.0f);
+
+    // If loading tool 0, we're done
+    none = emit_jump(Cond_LoadTool|RAPIDCHANGE_NOT);
+    manual = emit_jump(Cond_LoadPocket|RAPIDCHANGE_NOT);
+    if(atc.occupancy_check)
+        empty = emit_jump(Cond_LoadPocketFilled|RAPIDCHANGE_NOT);
+
+    // If selected tool has a pocket, perform automatic pick up
+    if(atc.spindle_traverse)
+        emit(Step_SpinStart, Spin_CW, atc.load_rpm);
+
+    if(atc.direct_traverse) {
+        pocket = emit_jump(Cond_DirectTraverse|RAPIDCHANGE_NOT);
+        if(atc.dust_cover == DustCover_UsePort)
+            emit(Step_DustCoverWait, 0, 0.0f);
+        emit(Step_PocketToPocket, Ref_Load, 0.0f);
+        engage = emit_jump(Cond_Always);
+        emit_label(pocket);
+    }
+
+    // The traverse height clears the pockets of the unload magazine only
+    pocket = emit_jump(Cond_OtherMagazine|RAPIDCHANGE_NOT);
+    emit(Step_Rapid, Ref_Machine, atc.z_safe_clearance);
+    emit_label(pocket);
+    emit(Step_RapidPocket, Ref_Load, 0.0f);
+    if(atc.dust_cover == DustCover_UsePort)
+        emit(Step_DustCoverWait, 0, 0.0f);
+    emit(Step_Rapid, Ref_Load, atc.z_engage + atc.z_start);
+
+    emit_label(engage);
+    if(atc.spindle_traverse)
+        emit(Step_SpinWait, 0, 0.0f);
+    else
+        emit(Step_Spin, Spin_CW, atc.load_rpm);
+    if(atc.seat_detection) {
+        // Engage again only if the nut did not seat
+        emit(Step_Engage, Ref_Load, atc.z_engage);
+        seated = emit_jump(Cond_Seated);
+        emit(Step_Rapid, Ref_Load, atc.z_engage + atc.z_retract);
+        emit(Step_Engage, Ref_Load, atc.z_engage);
+        emit_label(seated);
+    } else {
+        emit(Step_Feed, Ref_Load, atc.z_engage);
+        emit(Step_Rapid, Ref_Load, atc.z_engage + atc.z_retract);
+        emit(Step_Feed, Ref_Load, atc.z_engage);
+    }
+
+    if(atc.tool_recognition) {
+        emit(Step_Recognize, 0, 0.0f);
+        if(atc.engage_tune)
+            emit(Step_Tune, Engage_Load, 0.0f);
+
+        // If we don't have a tool rise and pause for a manual load
+        recognized = emit_jump(Cond_ToolLoaded);
+        if(side_loading())
+            emit(Step_Rapid, Ref_LoadAxis, atc.z_traverse);
+        emit_pause(Message_LoadFailed);
+        threaded = emit_jump(Cond_Always);
+
+        // If we show to have a tool in zone 2, we cross-threaded and need to manually load
+        emit_label(recognized);
+        recognized = emit_jump(Cond_ToolThreaded);
+        if(side_loading())
+            emit(Step_Rapid, Ref_LoadAxis, atc.z_traverse);
+        emit_pause(Message_LoadNotThreaded);
+        emit_label(recognized);
+        // Leave a side loaded magazine before the tool setter
+        if(side_loading())
+            emit(Step_Rapid, Ref_LoadAxis, atc.z_traverse);
+    } else {
+        threaded = RAPIDCHANGE_MAX_STEPS;
+        emit(Step_Rapid, Ref_LoadAxis, atc.z_traverse);
+        emit(Step_Spin, Spin_Stop, 0.0f);
+
+        // If the nut seated too early, we cross-threaded and need to manually load
+        if(atc.seat_detection) {
+            threaded = emit_jump(Cond_ToolThreaded);
+            emit_pause(Message_LoadNotThreaded);
+        }
+    }
+    done = emit_jump(Cond_Always);
+
+    // If the pocket is empty, rise and pause to load manually before moving into the magazine
+    if(atc.occupancy_check) {
+        emit_label(empty);
+        if(atc.spindle_traverse)
+            emit(Step_Spin, Spin_Stop, 0.0f);
+        emit_pause(Message_LoadPocketEmpty);
+        empty = emit_jump(Cond_Always);
+    }
+
+    // Otherwise, there is no pocket so let's rise and pause to load manually
+    emit_label(manual);
+    if(atc.spindle_traverse)
+        emit(Step_Spin, Spin_Stop, 0.0f);
+    emit_pause(Message_LoadNoPocket);
+
+    // We've loaded our tool
+    emit_label(done);
+    emit_label(threaded);
+    emit_label(empty);
+    emit(Step_Loaded, true, 0.0f);
+    done = emit_jump(Cond_Always);
+
+    emit_label(none);
+    if(atc.spindle_traverse)
+        emit(Step_Spin, Spin_Stop, 0.0f);
+    emit(Step_Loaded, false, 0.0f);
+    emit_label(done);
+}
+
+// Compile the tool change sequence from the dust cover opening till the restored program state.
+static void compile_sequence (void)
+{
+    n_steps = 0;
+
+    emit(Step_Phase, Phase_DustCoverOpen, 0.0f);
+    if(atc.dust_cover != DustCover_Disabled)
+        emit(Step_DustCover, true, 0.0f);
+
+    compile_unload();
+    compile_load();
+
+    emit(Step_Phase, Phase_SetTool, 0.0f);
+    emit(Step_SetTool, 0, 0.0f);
+
+    emit(Step_Phase, Phase_DustCoverClose, 0.0f);
+    if(atc.dust_cover != DustCover_Disabled)
+        emit(Step_DustCover, false, 0.0f);
+
+    emit(Step_Phase, Phase_RestoreState, 0.0f);
+    emit(Step_Restore, 0, 0.0f);
+    emit(Step_End, 0, 0.0f);
+
+    if(n_steps > RAPIDCHANGE_MAX_STEPS) {
+        n_steps = 0;
+        protocol_enqueue_foreground_task(report_warning, "RapidChange: Tool change sequence too long, increase RAPIDCHANGE_MAX_STEPS!");
+    }
+}
+
+static bool step_condition (atc_run_t *run, uint8_t condition)
+{
+    bool met;
+
+    switch(condition & ~RAPIDCHANGE_NOT) {
+        case Cond_UnloadTool:
+            met = run->plan->unload.tool_id != 0;
+            break;
+        case Cond_UnloadPocket:
+            met = run->plan->unload.has_pocket;
+            break;
+        case Cond_LoadTool:
+            met = run->plan->load.tool_id != 0;
+            break;
+        case Cond_LoadPocket:
+            met = run->plan->load.has_pocket;
+            break;
+        case Cond_DirectTraverse:
+            met = run->at_pocket_traverse && run->plan->same_magazine;
+            break;
+        case Cond_OtherMagazine:
+            met = run->at_pocket_traverse && !run->plan->same_magazine;
+            break;
+        case Cond_ToolSensed:
+            met = run->sensed.tool;
+            break;
+        case Cond_ToolLoaded:
+            met = run->sensed.loaded;
+            break;
+        case Cond_ToolThreaded:
+            met = run->sensed.threaded;
+            break;
+        case Cond_UnloadRetry:
+            if((met = run->retries < atc.unload_retries))
+                run->retries++;
+            break;
+        case Cond_UnloadPocketFree:
+            met = !pocket_known(run->plan->unload.pocket, true);
+            break;
+        case Cond_LoadPocketFilled:
+            met = !pocket_known(run->plan->load.pocket, false);
+            break;
+        case Cond_Seated:
+            met = run->sensed.seated;
+            break;
+        default:
+            met = true;
+            break;
+    }
+
+    return (condition & RAPIDCHANGE_NOT) ? !met : met;
+}
+
+static atc_pocket_plan_t *step_pocket (atc_change_plan_t *plan, atc_step_t *step)
+{
+    return step->arg == Ref_Unload || step->arg == Ref_UnloadAxis ? &plan->unload : &plan->load;
+}
+
+static uint_fast8_t step_axis (atc_change_plan_t *plan, atc_step_t *step)
+{
+    return step->arg == Ref_Machine ? Z_AXIS : pocket_axis(step_pocket(plan, step));
+}
+
+static float step_position (atc_change_plan_t *plan, atc_step_t *step)
+{
+    return step->arg == Ref_Machine ? step->value : pocket_position(step_pocket(plan, step), step->value, step->arg == Ref_Unload || step->arg == Ref_Load);
+}
+
+// The tool has been removed, the pocket holds the tool if dropped by the spindle.
+static void tool_unloaded (bool dropped)
+{
+    if(dropped) {
+        occupancy_set(change_plan.unload.pocket, true, true);
+        pocket_map_set(&change_plan.unload, current_tool.tool_id);
+        run.at_pocket_traverse = true;
+    }
+
+    // Set current tool to 0, only set for completeness, not used anywhere
+    current_tool.tool_id = 0;
+    spindle_pocket = RAPIDCHANGE_NO_POCKET;
+    // Cancel tool length offset
+    gc_set_tool_offset(ToolLengthOffset_Cancel, 0, 0.0f);
+}
+
+static bool tool_loaded (bool synchronize)
+{
+    if(synchronize) {
+        if(!sync_motion())
+            return false;
+        sync_position();
+    }
+
+    memcpy(&current_tool, next_tool, sizeof(tool_data_t));
+    spindle_pocket = change_plan.load.pocket;
+    occupancy_set(change_plan.load.pocket, true, false);
+    pocket_map_set(&change_plan.load, 0);
+    checkpoint.tool_length_pending = change_plan.set_tool != SetTool_None;
+
+    return true;
+}
+
+// Record the tool in the spindle and the pocket map at a phase boundary.
+static void checkpoint_update (void)
+{
+    checkpoint.tool_id = current_tool.tool_id;
+    checkpoint.pocket = spindle_pocket;
+    if(checkpoint.tool_id == 0)
+        checkpoint.tool_length_pending = false;
+
+    checkpoint_save();
+}
+
+static bool execute_step (atc_step_t *step)
+{
+    bool ok = true;
+
+    switch((atc_opcode_t)step->op) {
+
+        case Step_Phase:
+            checkpoint_update();
+            phase_start((atc_phase_t)step->arg);
+            RAPIDCHANGE_LOG_INFO("%s.", atc_phase_names[step->arg]);
+            break;
+
+        case Step_Rapid:
+            ok = rapid_on_axis(step_axis(&change_plan, step), step_position(&change_plan, step));
+            break;
+
+        case Step_Feed:
+            ok = move_on_axis(step_axis(&change_plan, step), step_position(&change_plan, step), engage_feed_rate());
+            break;
+
+        case Step_Engage:
+            ok = engage(step_axis(&change_plan, step), step_position(&change_plan, step));
+            break;
+
+        case Step_RapidPocket:
+            ok = rapid_to_pocket_xy(step_pocket(&change_plan, step));
+            break;
+
+        case Step_PocketToPocket:
+            ok = rapid_pocket_to_pocket(&change_plan);
+            break;
+
+        case Step_Spin:
+            if(step->arg == Spin_Stop)
+                ok = spin_stop();
+            else
+                ok = spin((spindle_state_t){ .on = On, .ccw = step->arg == Spin_CCW }, engage_rpm((atc_spin_t)step->arg, step->value));
+            break;
+
+        case Step_SpinStart:
+            ok = spin_start((spindle_state_t){ .on = On, .ccw = step->arg == Spin_CCW }, engage_rpm((atc_spin_t)step->arg, step->value));
+            break;
+
+        case Step_SpinWait:
+            ok = spin_wait();
+            break;
+
+        case Step_Sense:
+            run.sensed.tool = spindle_has_tool();
+            ok = !ABORTED;
+            break;
+
+        case Step_Recognize:
+            ok = recognize_loaded_tool(&change_plan.load, &run.sensed.loaded, &run.sensed.threaded);
+            break;
 
-    target.z = atc.z_safe_clearance;
-    mc_line(target.values, &plan_data);
+        case Step_SenseRetract:
+            ok = retract_and_sense(step_pocket(&change_plan, step), step_position(&change_plan, step), &run.sensed.tool);
+            break;
 
-    if(!settings.flags.no_restore_position_after_M6) {
-        memcpy(&target, &previous, sizeof(coord_data_t));
-        target.z = atc.z_safe_clearance;
-        mc_line(target.values, &plan_data);
-    }
+        case Step_Barrier:
+            ok = sync_motion();
+            break;
 
-    if(protocol_buffer_synchronize()) {
+        case Step_Pause:
+            ok = pause((atc_message_t)step->arg);
+            break;
 
-        sync_position();
+        case Step_DustCover:
+            ok = open_dust_cover(step->arg);
+            break;
 
-        coolant_sync(gc_state.modal.coolant);
-        spindle_restore(plan_data.spindle.hal, gc_state.modal.spindle.state, gc_state.spindle.rpm);
+        case Step_DustCoverWait:
+            ok = dust_cover_wait();
+            break;
 
-        if(!settings.flags.no_restore_position_after_M6) {
-            previous.z += gc_get_offset(Z_AXIS);
-            mc_line(previous.values, &plan_data);
-        }
-    }
+        case Step_Unloaded:
+            tool_unloaded(step->arg);
+            break;
 
-    if(protocol_buffer_synchronize()) {
-        sync_position();
-        // Already done after load tool
-        // memcpy(&current_tool, next_tool, sizeof(tool_data_t));
-    }
+        case Step_Loaded:
+            ok = tool_loaded(step->arg);
+            break;
 
-    return !ABORTED;
-}
+        case Step_SetTool:
+            if((ok = set_tool()))
+                checkpoint.tool_length_pending = false;
+            break;
 
-static bool restore_program_state (void) {
-    if(current_tool.tool_id == 0) {
-        return true;
-    }
-    RAPIDCHANGE_DEBUG_PRINT("Restore.");
+        case Step_Restore:
+            ok = restore_program_state();
+            break;
 
-    // Get current position.
-    system_convert_array_steps_to_mpos(target.values, sys.position);
+        case Step_Tune:
+            tune_record((atc_engage_t)step->arg, step->arg == Engage_Unload ? !run.sensed.tool : run.sensed.loaded && run.sensed.threaded);
+            break;
 
-    bool ok = restore();
+        default:
+            break;
+    }
 
     return ok;
 }
 
-static void set_tool_change_state(void) {
-    RAPIDCHANGE_DEBUG_PRINT("Set tool change state.");
-    protocol_buffer_synchronize();
-    sync_position();
-}
+// Execute the compiled tool change sequence from the given step. Each step completes before the next one is executed,
+// the waits for the motion, the spindle, the dust cover and a resume service the foreground loop meanwhile.
+static bool sequence_run (uint_fast8_t pc)
+{
+    bool ok = n_steps != 0;
 
-static void pause (void) {
-    system_set_exec_state_flag(EXEC_FEED_HOLD); // Use feed hold for program pause.
-    protocol_execute_realtime(); // Execute suspend
-}
+    memset(&run.sensed, 0, sizeof(atc_sensed_t));
+    run.retries = 0;
 
-static bool unload_tool(void) {
-    if(!rapid_to_z(atc.z_safe_clearance))
-        return false;
+    while(ok && sequence[pc].op != Step_End) {
+        atc_step_t *step = &sequence[pc];
 
-    // If we don't have a tool we're done
-    if(current_tool.tool_id == 0) {
-        return true;
+        if(step->op == Step_Jump)
+            pc = step_condition(&run, step->arg) ? step->jump : pc + 1;
+        else {
+            RAPIDCHANGE_LOG_DEBUG("Step %u: %u", (unsigned)pc, step->op);
+            ok = execute_step(step) && !ABORTED;
+            pc++;
+        }
     }
 
-    RAPIDCHANGE_DEBUG_PRINT("Unload tool.");
+    return ok;
+}
 
-    // If the tool has a pocket, unload
-    if(tool_has_pocket(current_tool.tool_id)) {
+static void execute_realtime (sys_state_t state)
+{
+#if RAPIDCHANGE_DEBUG
+    if(reset_log.pending) {
+        reset_log.pending = false;
+        RAPIDCHANGE_LOG_INFO("Reset.");
+        if(reset_log.change) {
+            RAPIDCHANGE_LOG_DEBUG("Current tool: %lu", (unsigned long)reset_log.current_tool);
+            RAPIDCHANGE_LOG_DEBUG("Next tool: %lu", (unsigned long)reset_log.next_tool);
+        }
+    }
+#endif
+    store_poll(state);
 
-        // Perform first attempt
-        if(!rapid_to_pocket_xy(current_tool.tool_id))
-            return false;
+    on_execute_realtime(state);
+}
 
-        if(!rapid_to_z(atc.z_engage + atc.z_start))
-            return false;
-        spin_ccw(atc.unload_rpm);
-        if(!linear_to_z(atc.z_engage, atc.engage_feed_rate))
-            return false;
+// Time (ms) of the rapid traverse between the XY positions. Like the core plans the move the rate and the acceleration
+// are limited by the axes moving, the traverse accelerates to the rate and decelerates to a stop.
+static float traverse_time (coord_data_t *from, coord_data_t *to) {
+    float distance = xy_distance(from, to), rate = 0.0f, acceleration = 0.0f;
+
+    if(distance == 0.0f)
+        return 0.0f;
+
+    for(uint_fast8_t idx = X_AXIS; idx <= Y_AXIS; idx++) {
+        float unit = fabsf(to->values[idx] - from->values[idx]) / distance;
+        if(unit > 0.0f) {
+            if(rate == 0.0f || settings.axis[idx].max_rate / unit < rate)
+                rate = settings.axis[idx].max_rate / unit;
+            if(acceleration == 0.0f || settings.axis[idx].acceleration / unit < acceleration)
+                acceleration = settings.axis[idx].acceleration / unit;
+        }
+    }
 
-        // If we're using tool recognition, handle it
-        if(atc.tool_recognition) {
-            RAPIDCHANGE_DEBUG_PRINT("Move to recognition zone 1.");
-            if(!rapid_to_z(atc.tool_recognition_z_zone_1))
-                return false;
+    // Settings are in mm/min and mm/min^2, a traverse too short to reach the rate is a triangle
+    if(distance < rate * rate / acceleration)
+        return 2.0f * sqrtf(distance / acceleration) * 60000.0f;
 
-            // If we have a tool, try unloading one more time
-            if (spindle_has_tool()) {
-                RAPIDCHANGE_DEBUG_PRINT("Try to unload one more time.");
-                if(!rapid_to_z(atc.z_engage + atc.z_start))
-                    return false;
-                if(!linear_to_z(atc.z_engage, atc.engage_feed_rate))
-                    return false;
-                if(!rapid_to_z(atc.tool_recognition_z_zone_1))
-                    return false;
-            }
+    return (distance / rate + rate / acceleration) * 60000.0f;
+}
 
-            // Whether successful or not, we're done trying
-            spin_stop();
-
-            // If we have a tool at this point, rise and pause for manual unloading
-            if (spindle_has_tool()) {
-                if(!rapid_to_z(atc.z_safe_clearance))
-                    return false;
-                protocol_enqueue_foreground_task(report_warning, "RapidChange: Failed to unload the current tool. Please unload the tool manually and cycle start to continue.");
-                pause();
-            // Otherwise, get ready to unload
-            } else {
-                if(!rapid_to_z(atc.z_traverse))
-                    return false;
+// Estimate the tool changes of a job from the current tool and position, the pockets are updated as by the
+// tool changes and restored afterwards. The travel and the traverse time are taken along the pockets planned
+// for each change.
+static void estimate_job (tool_id_t *job, uint_fast8_t n_changes, atc_job_t *total, float *travel, uint32_t *time)
+{
+    static atc_change_plan_t plan;
+    tool_id_t pocket_tool[RAPIDCHANGE_MAX_POCKETS];
+    uint8_t pocket = spindle_pocket;
+    tool_id_t tool_id = current_tool.tool_id;
+    coord_data_t position;
+
+    for(uint_fast8_t idx = 0; idx < n_pockets; idx++)
+        pocket_tool[idx] = pocket_table[idx].tool_id;
+
+    memset(total, 0, sizeof(atc_job_t));
+    system_convert_array_steps_to_mpos(position.values, sys.position);
+
+    for(uint_fast8_t change = 0; change < n_changes; change++) {
+        float distance = 0.0f, duration = 0.0f;
+
+        if(job[change] != tool_id) {
+            plan_tool_change(&plan, tool_id, job[change], &position);
+
+            if(tool_id != 0) {
+                distance += xy_distance(&position, &plan.unload.position);
+                duration += traverse_time(&position, &plan.unload.position);
+                position = plan.unload.position;
+                if(!plan.unload.has_pocket)
+                    total->pauses++;
+            }
+            if(job[change] != 0) {
+                distance += xy_distance(&position, &plan.load.position);
+                duration += traverse_time(&position, &plan.load.position);
+                position = plan.load.position;
+                if(!plan.load.has_pocket)
+                    total->pauses++;
             }
 
-        // If we're not using tool recognition, go straight to traverse height for loading
-        } else {
-            if(!rapid_to_z(atc.z_traverse))
-                return false;
-            spin_stop();
+            if(atc.dynamic_pockets) {
+                if(plan.unload.has_pocket)
+                    pocket_table[plan.unload.pocket].tool_id = tool_id;
+                if(plan.load.has_pocket)
+                    pocket_table[plan.load.pocket].tool_id = 0;
+                build_tool_index();
+            }
+            spindle_pocket = plan.load.pocket;
+            tool_id = job[change];
         }
 
-    // If the tool doesn't have a pocket, let's pause for manual removal
-    } else {
-        protocol_enqueue_foreground_task(report_warning, "RapidChange: Current tool does not have an assigned pocket. Please unload the tool manually and cycle start to continue.");
-        pause();
+        total->travel += distance;
+        total->time += (uint32_t)duration;
+        if(travel)
+            travel[change] = distance;
+        if(time)
+            time[change] = (uint32_t)duration;
     }
 
-    // The tool has been removed, set current tool to 0, only set for completeness, not used anywhere
-    current_tool.tool_id = 0;
-    // Cancel tool length offset
-    gc_set_tool_offset(ToolLengthOffset_Cancel, 0, 0.0f);
+    for(uint_fast8_t idx = 0; idx < n_pockets; idx++)
+        pocket_table[idx].tool_id = pocket_tool[idx];
+    build_tool_index();
+    spindle_pocket = pocket;
+}
 
-    return true;
+// Count the changes between two tools of a job.
+static uint_fast8_t job_transitions (tool_id_t *job, uint_fast8_t n_changes, tool_id_t a, tool_id_t b)
+{
+    uint_fast8_t count = 0;
+    tool_id_t tool_id = current_tool.tool_id;
+
+    for(uint_fast8_t change = 0; change < n_changes; tool_id = job[change++]) {
+        if((tool_id == a && job[change] == b) || (tool_id == b && job[change] == a))
+            count++;
+    }
+
+    return count;
 }
 
-static bool load_tool(tool_id_t tool_id) {
-    // If loading tool 0, we're done
-    if(tool_id == 0) {
-        memcpy(&current_tool, next_tool, sizeof(tool_data_t));
-        return true;
+static bool job_has_tool (tool_id_t *job, uint_fast8_t n_changes, tool_id_t tool_id)
+{
+    for(uint_fast8_t change = 0; change < n_changes; change++) {
+        if(job[change] == tool_id)
+            return true;
     }
 
-    RAPIDCHANGE_DEBUG_PRINT("Load tool.");
+    return tool_id == current_tool.tool_id;
+}
 
-    // If selected tool has a pocket, perform automatic pick up
-    if(tool_has_pocket(tool_id)) {
-        if(!rapid_to_pocket_xy(tool_id))
-            return false;
-        if(!rapid_to_z(atc.z_engage + atc.z_start))
-            return false;
-        spin_cw(atc.load_rpm);
-        if(!linear_to_z(atc.z_engage, atc.engage_feed_rate))
-            return false;
-        if(!rapid_to_z(atc.z_engage + atc.z_retract))
-            return false;
-        if(!linear_to_z(atc.z_engage, atc.engage_feed_rate))
-            return false;
+// Suggest a pocket assignment for the job, the tools are placed in pocket order with the tool changed to most often
+// from the tool placed before next. The pocket of the tool in the spindle is left empty for its unload,
+// tools not used by the job keep their pocket if possible.
+static void suggest_pocket_map (atc_pocket_map_t *map, tool_id_t *job, uint_fast8_t n_changes)
+{
+    uint_fast8_t idx, pocket = 0;
+    tool_id_t tool_id = current_tool.tool_id;
 
-        // If we're using tool recognition, let's handle it
-        if(atc.tool_recognition) {
-            RAPIDCHANGE_DEBUG_PRINT("Move to recognition zone 1.");
-            if (!rapid_to_z(atc.tool_recognition_z_zone_1))
-                return false;
-            spin_stop();
-
-            // If we don't have a tool rise and pause for a manual load
-            if (!spindle_has_tool()) {
-                if(!rapid_to_z(atc.z_safe_clearance))
-                    return false;
-                protocol_enqueue_foreground_task(report_warning, "RapidChange: Failed to load the selected tool. Please load the tool manually and cycle start to continue.");
-                pause();
-
-            // Otherwise we have a tool and can perform the next check
-            } else {
-                RAPIDCHANGE_DEBUG_PRINT("Move to recognition zone 2.");
-                if (!rapid_to_z(atc.tool_recognition_z_zone_2))
-                    return false;
-                // If we show to have a tool here, we cross-threaded and need to manually load
-                if (spindle_has_tool()) {
-                    if(!rapid_to_z(atc.z_safe_clearance))
-                        return false;
-
-                    protocol_enqueue_foreground_task(report_warning, "RapidChange: Failed to properly thread the selected tool. Please reload the tool manually and cycle start to continue.");
-                    pause();
-                } // Otherwise all went well
-                RAPIDCHANGE_DEBUG_PRINT("Tool recognized.");
+    memset(map, 0, sizeof(atc_pocket_map_t));
+    map->n_pockets = n_pockets;
+
+    if(tool_id != 0)
+        pocket++;
+
+    while(pocket < n_pockets) {
+        tool_id_t next = 0;
+        uint_fast8_t count, max = 0;
+
+        // Pick the unplaced tool with the most changes from the last placed tool, the first used on a tie
+        for(uint_fast8_t change = 0; change < n_changes; change++) {
+            tool_id_t candidate = job[change];
+            bool placed = candidate == 0 || candidate > RAPIDCHANGE_MAX_TOOLS || candidate == current_tool.tool_id;
+
+            for(idx = 0; !placed && idx < pocket; idx++)
+                placed = map->tool[idx] == candidate;
+            if(placed)
+                continue;
+
+            count = job_transitions(job, n_changes, tool_id, candidate);
+            if(next == 0 || count > max) {
+                next = candidate;
+                max = count;
             }
-        } else {
-            if(!rapid_to_z(atc.z_traverse))
-                return false;
-            spin_stop();
         }
 
+        if(next == 0)
+            break;
 
-    // Otherwise, there is no pocket so let's rise and pause to load manually
-    } else {
-        if(!rapid_to_z(atc.z_safe_clearance))
-            return false;
-        RAPIDCHANGE_DEBUG_PRINT("Selected tool does not have an assigned pocket.");
-        RAPIDCHANGE_DEBUG_PRINT("Please load the selected tool and press cycle start to continue.");
-        pause();
+        map->tool[pocket++] = tool_id = next;
     }
 
-    // We've loaded our tool
-    if(protocol_buffer_synchronize()) {
-        sync_position();
-        memcpy(&current_tool, next_tool, sizeof(tool_data_t));
+    // Tools not used by the job keep their pocket or take the next free one
+    for(idx = 0; idx < n_pockets; idx++) {
+        if((tool_id = pocket_table[idx].tool_id) == 0 || job_has_tool(job, n_changes, tool_id))
+            continue;
+        if(idx < pocket || map->tool[idx] != 0) {
+            uint_fast8_t free = pocket;
+            while(free < n_pockets && map->tool[free] != 0)
+                free++;
+            if(free < n_pockets)
+                map->tool[free] = tool_id;
+        } else
+            map->tool[idx] = tool_id;
     }
+}
 
-    return true;
+static void report_job (const char *name, atc_job_t *total)
+{
+    hal.stream.write("[RCPLAN:");
+    hal.stream.write(name);
+    hal.stream.write("|");
+    hal.stream.write(uitoa(total->time));
+    hal.stream.write("|");
+    hal.stream.write(ftoa(total->travel, 1));
+    hal.stream.write("|");
+    hal.stream.write(uitoa(total->pauses));
+    hal.stream.write("]" ASCII_EOL);
 }
 
-static bool set_tool (void) {
-    // If the tool setter is disabled or if we don't have a tool, rise up and be done
-    if(!atc.tool_setter || current_tool.tool_id == 0) {
-        if(!rapid_to_z(atc.z_safe_clearance))
-            return false;
-        return true;
+// Plan the tool changes of a job, $RCPLAN=<tool>,<tool>,... with the tools in the order of the M6 of the job.
+// With dynamic pockets a pocket assignment is suggested, $RCPLAN applies it once the tools are placed accordingly.
+static status_code_t plan_command (sys_state_t state, char *args)
+{
+    static tool_id_t job[RAPIDCHANGE_PLAN_CHANGES];
+    static float travel[RAPIDCHANGE_PLAN_CHANGES];
+    static uint32_t time[RAPIDCHANGE_PLAN_CHANGES];
+    uint_fast8_t n_changes = 0;
+    tool_id_t tool_id;
+    atc_job_t total;
+    char *end;
+
+    if(args == NULL) {
+        if(!atc.dynamic_pockets || plan_map.n_pockets == 0 || plan_map.n_pockets != n_pockets)
+            return Status_InvalidStatement;
+
+        memcpy(&pocket_map, &plan_map, sizeof(atc_pocket_map_t));
+        plan_map.n_pockets = 0;
+        for(uint_fast8_t idx = 0; idx < n_pockets; idx++)
+            pocket_table[idx].tool_id = pocket_map.tool[idx];
+        build_tool_index();
+        pocket_map_save();
+        change_plan.valid = false;
+
+        return Status_OK;
     }
-    RAPIDCHANGE_DEBUG_PRINT("Set tool length.");
 
-    RAPIDCHANGE_DEBUG_PRINT("Move to probe.");
-    if(!rapid_to_z(atc.z_safe_clearance))
-        return false;
-    if(!rapid_to_tool_setter_xy())
-        return false;
-    if(!rapid_to_z(atc.tool_setter_z_seek_start))
-        return false;
+    do {
+        if(n_changes == RAPIDCHANGE_PLAN_CHANGES)
+            return Status_GcodeValueOutOfRange;
+        job[n_changes++] = strtoul(args, &end, 10);
+        args = end + 1;
+    } while(*end == ',');
+
+    if(*end != '\0')
+        return Status_BadNumberFormat;
+
+    estimate_job(job, n_changes, &total, travel, time);
+
+    tool_id = current_tool.tool_id;
+    for(uint_fast8_t change = 0; change < n_changes; tool_id = job[change++]) {
+        hal.stream.write("[RCPLAN:");
+        hal.stream.write(uitoa(change + 1));
+        hal.stream.write("|");
+        hal.stream.write(uitoa(tool_id));
+        hal.stream.write("|");
+        hal.stream.write(uitoa(job[change]));
+        hal.stream.write("|");
+        hal.stream.write(ftoa(travel[change], 1));
+        hal.stream.write("|");
+        hal.stream.write(uitoa(time[change]));
+        hal.stream.write("]" ASCII_EOL);
+    }
+    report_job("Total", &total);
 
-    RAPIDCHANGE_DEBUG_PRINT("Probe cycle.");
-    // Probe cycle using GCode interface since tool change interface is private
-    plan_line_data_t plan_data;
-    gc_parser_flags_t flags = {0};
+    if(atc.dynamic_pockets) {
+        tool_id_t pocket_tool[RAPIDCHANGE_MAX_POCKETS];
 
-    plan_data_init(&plan_data);
-    plan_data.feed_rate = atc.tool_setter_seek_feed_rate;
-    target.z -= atc.tool_setter_max_travel;
-    bool ok = true;
-    // Locate probe
-    if((ok = ok && mc_probe_cycle(target.values, &plan_data, flags) == GCProbe_Found))
-    {
-        system_convert_array_steps_to_mpos(target.values, sys.probe_position);
+        suggest_pocket_map(&plan_map, job, n_changes);
 
-        // Retract a bit and perform slow probe
-        target.z += atc.tool_setter_seek_retreat;
-        if((ok = mc_line(target.values, &plan_data))) {
-            plan_data.feed_rate = atc.tool_setter_set_feed_rate;
-            target.z -= (atc.tool_setter_seek_retreat + 2.0f);
-            ok = mc_probe_cycle(target.values, &plan_data, flags) == GCProbe_Found;
+        for(uint_fast8_t idx = 0; idx < n_pockets; idx++) {
+            pocket_tool[idx] = pocket_table[idx].tool_id;
+            pocket_table[idx].tool_id = plan_map.tool[idx];
+            hal.stream.write("[RCPLAN:Pocket|");
+            hal.stream.write(uitoa(idx + 1));
+            hal.stream.write("|");
+            hal.stream.write(uitoa(plan_map.tool[idx]));
+            hal.stream.write("]" ASCII_EOL);
         }
-    }
+        build_tool_index();
+        estimate_job(job, n_changes, &total, NULL, NULL);
+        for(uint_fast8_t idx = 0; idx < n_pockets; idx++)
+            pocket_table[idx].tool_id = pocket_tool[idx];
+        build_tool_index();
 
-    if(ok) {
-        if(!(sys.tlo_reference_set.mask & bit(Z_AXIS))) {
-            RAPIDCHANGE_DEBUG_PRINT("Set TLO reference.");
-            sys.tlo_reference[Z_AXIS] = sys.probe_position[Z_AXIS];
-            sys.tlo_reference_set.mask |= bit(Z_AXIS);
-            system_add_rt_report(Report_TLOReference);
-            grbl.report.feedback_message(Message_ReferenceTLOEstablished);
-        } else {
-            RAPIDCHANGE_DEBUG_PRINT("Set TLO.");
-            gc_set_tool_offset(ToolLengthOffset_EnableDynamic, Z_AXIS,
-                               sys.probe_position[Z_AXIS] - sys.tlo_reference[Z_AXIS]);
-        }
+        report_job("Suggested", &total);
     }
 
-    RAPIDCHANGE_DEBUG_PRINT("End of probing.");
-    if(ok)
-      if(!rapid_to_z(atc.z_safe_clearance))
-        return false;
-
-    return ok;
+    return Status_OK;
 }
 
 // HAL tool change API
 // Set next and/or current tool. Called by gcode.c on on a Tn or M61 command (via HAL).
 static void tool_select (tool_data_t *tool, bool next)
 {
-    RAPIDCHANGE_DEBUG_PRINT("Tool select.");
+    RAPIDCHANGE_LOG_DEBUG("Tool select.");
     next_tool = tool;
-    if(!next)
+    if(!next) {
         memcpy(&current_tool, tool, sizeof(tool_data_t));
-    char tool_msg[20];
-    sprintf(tool_msg, "Current tool: %lu", current_tool.tool_id);
-    RAPIDCHANGE_DEBUG_PRINT(tool_msg);
-    sprintf(tool_msg, "Next tool: %lu", next_tool->tool_id);
-    RAPIDCHANGE_DEBUG_PRINT(tool_msg);
+        spindle_pocket = RAPIDCHANGE_NO_POCKET;
+        checkpoint.tool_length_pending = false;
+        checkpoint_update();
+    }
+
+    plan_tool_change(&change_plan, current_tool.tool_id, next_tool->tool_id, NULL);
+    RAPIDCHANGE_LOG_DEBUG("Current tool: %lu", (unsigned long)current_tool.tool_id);
+    RAPIDCHANGE_LOG_DEBUG("Next tool: %lu", (unsigned long)next_tool->tool_id);
 }
 
 // Start a tool change sequence. Called by gcode.c on a M6 command (via HAL).
 static status_code_t tool_change (parser_state_t *parser_state)
 {
     bool ok = true;
-    RAPIDCHANGE_DEBUG_PRINT("Tool change start.");
+    RAPIDCHANGE_LOG_INFO("Tool change start.");
     if(next_tool == NULL) {
-        RAPIDCHANGE_DEBUG_PRINT("Next tool is not available!");
+        RAPIDCHANGE_LOG_ERROR("Next tool is not available!");
         return Status_GCodeToolError;
     }
 
-    if(current_tool.tool_id == next_tool->tool_id) {
-        RAPIDCHANGE_DEBUG_PRINT("Current tool selected, tool change bypassed.");
+    bool resume = current_tool.tool_id == next_tool->tool_id && checkpoint.tool_length_pending;
+
+    if(current_tool.tool_id == next_tool->tool_id && !resume) {
+        RAPIDCHANGE_LOG_INFO("Current tool selected, tool change bypassed.");
         return Status_OK;
     }
 
     // Require homing
     uint8_t homed_req = (X_AXIS_BIT|Y_AXIS_BIT|Z_AXIS_BIT);
     if((sys.homed.mask & homed_req) != homed_req) {
-        RAPIDCHANGE_DEBUG_PRINT("Homing is required before tool change.");
+        RAPIDCHANGE_LOG_ERROR("Homing is required before tool change.");
         return Status_HomingRequired;
     }
 
     message_start();
     protocol_buffer_synchronize();
 
+    // Plan again from the position the change starts at if not prepared on tool select or the current tool was changed since
+    if(!(change_plan.valid && change_plan.unload.tool_id == current_tool.tool_id && change_plan.load.tool_id == next_tool->tool_id)) {
+        coord_data_t position;
+        system_convert_array_steps_to_mpos(position.values, sys.position);
+        plan_tool_change(&change_plan, current_tool.tool_id, next_tool->tool_id, &position);
+    }
+
+    memset(&timing.current, 0, sizeof(atc_phase_times_t));
+    run.at_pocket_traverse = false;
+    dust_cover_opening = false;
+    tlo_cache.changes++;
+
+    phase_start(Phase_RecordState);
     record_program_state();
     set_tool_change_state();
 
-    ok = open_dust_cover(true);
-    if(!ok)
-        return Status_GCodeToolError;
+    // Continue an interrupted tool change after the tool was loaded with setting the tool length
+    ok = sequence_run(resume ? phase_step[Phase_SetTool] : 0);
+    checkpoint_update();
 
-    ok = unload_tool();
-    if(!ok)
-        return Status_GCodeToolError;
+    phase_start(Phase_Idle);
 
-    ok = load_tool(next_tool->tool_id);
-    if(!ok)
-        return Status_GCodeToolError;
+    if(atc.tool_setter)
+        tlo_cache_save();
 
-    ok = set_tool();
     if(!ok)
         return Status_GCodeToolError;
 
-    ok = open_dust_cover(false);
-    if(!ok)
-        return Status_GCodeToolError;
+    RAPIDCHANGE_LOG_INFO("Tool change finished.");
+    record_timing();
 
-    ok = restore_program_state();
-    if(!ok)
-        return Status_GCodeToolError;
+    return Status_OK;
+}
+
+// Report the stored tool lengths or invalidate the stored length of a tool, 0 invalidates all tools.
+static status_code_t tlo_cache_command (sys_state_t state, char *args)
+{
+    if(args == NULL) {
+        for(tool_id_t tool_id = 1; tool_id <= RAPIDCHANGE_MAX_TOOLS; tool_id++) {
+            atc_tlo_cache_t *cache = &tlo_cache.tool[tool_id - 1];
+            if(!cache->valid)
+                continue;
+            hal.stream.write("[RCTLO:");
+            hal.stream.write(uitoa(tool_id));
+            hal.stream.write("|");
+            hal.stream.write(ftoa((float)cache->probe_z / settings.axis[Z_AXIS].steps_per_mm, 3));
+            hal.stream.write("|");
+            hal.stream.write(uitoa((uint16_t)(tlo_cache.changes - cache->measured_at)));
+            hal.stream.write("|");
+            hal.stream.write(uitoa(cache->uses));
+            hal.stream.write("]" ASCII_EOL);
+        }
+        return Status_OK;
+    }
+
+    char *end;
+    uint32_t tool_id = strtoul(args, &end, 10);
+
+    if(*end != '\0')
+        return Status_BadNumberFormat;
+
+    if(tool_id == 0) {
+        for(uint_fast8_t idx = 0; idx < RAPIDCHANGE_MAX_TOOLS; idx++)
+            tlo_cache.tool[idx].valid = false;
+    } else {
+        atc_tlo_cache_t *cache = get_tlo_cache(tool_id);
+        if(cache == NULL)
+            return Status_GcodeValueOutOfRange;
+        cache->valid = false;
+    }
+
+    tlo_cache_save();
+    change_plan.valid = false;
+
+    return Status_OK;
+}
 
-    RAPIDCHANGE_DEBUG_PRINT("Tool change finished.");
+// Report the auto tuned engage speeds, $RCTUNE=0 restarts the auto tune at the settings.
+static status_code_t tune_command (sys_state_t state, char *args)
+{
+    static const char *engage_names[] = { "Load", "Unload" };
+
+    if(args == NULL) {
+        for(uint_fast8_t engage = 0; engage < Engage_Count; engage++) {
+            hal.stream.write("[RCTUNE:");
+            hal.stream.write(engage_names[engage]);
+            hal.stream.write("|");
+            hal.stream.write(uitoa(tune[engage].level));
+            hal.stream.write("|");
+            hal.stream.write(ftoa(engage_feed_rate(), 0));
+            hal.stream.write("|");
+            hal.stream.write(ftoa(engage == Engage_Load ? engage_rpm(Spin_CW, atc.load_rpm) : engage_rpm(Spin_CCW, atc.unload_rpm), 0));
+            hal.stream.write("|");
+            hal.stream.write(uitoa(tune[engage].engages));
+            hal.stream.write("|");
+            hal.stream.write(uitoa(tune[engage].failures));
+            hal.stream.write("]" ASCII_EOL);
+        }
+
+        return Status_OK;
+    }
+
+    if(strcmp(args, "0"))
+        return Status_GcodeValueOutOfRange;
+
+    memset(tune, 0, sizeof(tune));
+    tune_save();
+
+    return Status_OK;
+}
+
+// Report the pocket positions with their corrections or set the corrections of a pocket,
+// $RCPOCKET=<pocket>,<x>,<y>,<z> sets the corrections, $RCPOCKET=<pocket> clears them.
+static status_code_t pocket_command (sys_state_t state, char *args)
+{
+    if(args == NULL) {
+        for(uint_fast8_t idx = 0; idx < n_pockets; idx++) {
+            hal.stream.write("[RCPOCKET:");
+            hal.stream.write(uitoa(idx + 1));
+            hal.stream.write("|");
+            hal.stream.write(uitoa(pocket_table[idx].magazine + 1));
+            hal.stream.write("|");
+            hal.stream.write(uitoa(pocket_table[idx].tool_id));
+            hal.stream.write("|");
+            hal.stream.write(ftoa(pocket_table[idx].position.x, 3));
+            hal.stream.write(",");
+            hal.stream.write(ftoa(pocket_table[idx].position.y, 3));
+            hal.stream.write("|");
+            hal.stream.write(ftoa(pocket_correction[idx].x, 3));
+            hal.stream.write(",");
+            hal.stream.write(ftoa(pocket_correction[idx].y, 3));
+            hal.stream.write(",");
+            hal.stream.write(ftoa(pocket_correction[idx].z, 3));
+            hal.stream.write("]" ASCII_EOL);
+        }
+        return Status_OK;
+    }
+
+    char *end;
+    atc_pocket_correction_t correction = {0};
+    uint32_t pocket = strtoul(args, &end, 10);
+
+    if(*end == ',') {
+        correction.x = strtof(end + 1, &end);
+        if(*end == ',')
+            correction.y = strtof(end + 1, &end);
+        if(*end == ',')
+            correction.z = strtof(end + 1, &end);
+    }
+
+    if(*end != '\0')
+        return Status_BadNumberFormat;
+
+    if(pocket == 0 || pocket > n_pockets)
+        return Status_GcodeValueOutOfRange;
+
+    pocket_correction[pocket - 1] = correction;
+    pocket_correction_save();
+    build_pocket_table();
+    change_plan.valid = false;
+
+    return Status_OK;
+}
+
+// Assign a tool to a pocket of the dynamic pocket map, $RCMAP=<pocket>,<tool> assigns the tool, 0 empties
+// the pocket, $RCMAP=0 restores the tools of the magazine layout.
+static status_code_t pocket_map_command (sys_state_t state, char *args)
+{
+    if(!atc.dynamic_pockets)
+        return Status_InvalidStatement;
+
+    if(args == NULL) {
+        for(uint_fast8_t idx = 0; idx < n_pockets; idx++) {
+            hal.stream.write("[RCMAP:");
+            hal.stream.write(uitoa(idx + 1));
+            hal.stream.write("|");
+            hal.stream.write(uitoa(pocket_table[idx].tool_id));
+            hal.stream.write("]" ASCII_EOL);
+        }
+        return Status_OK;
+    }
+
+    char *end;
+    uint32_t tool_id = 0, pocket = strtoul(args, &end, 10);
+
+    if(*end == ',')
+        tool_id = strtoul(end + 1, &end, 10);
+
+    if(*end != '\0')
+        return Status_BadNumberFormat;
+
+    if(pocket > n_pockets || tool_id > RAPIDCHANGE_MAX_TOOLS)
+        return Status_GcodeValueOutOfRange;
+
+    if(pocket == 0) {
+        pocket_map.n_pockets = 0;
+        build_pocket_table();
+    } else {
+        pocket_map.tool[pocket - 1] = tool_id;
+        pocket_table[pocket - 1].tool_id = tool_id;
+        build_tool_index();
+    }
+
+    pocket_map_save();
+    change_plan.valid = false;
+
+    return Status_OK;
+}
+
+// Report the pocket occupancy: 0 empty, 1 occupied, 2 unknown, or set a pocket empty or occupied, 0 forgets all pockets.
+static status_code_t occupancy_command (sys_state_t state, char *args)
+{
+    if(args == NULL) {
+        for(uint_fast8_t idx = 0; idx < n_pockets; idx++) {
+            hal.stream.write("[RCOCCUPY:");
+            hal.stream.write(uitoa(idx + 1));
+            hal.stream.write("|");
+            hal.stream.write(uitoa(pocket_known(idx, true) ? 1 : pocket_known(idx, false) ? 0 : 2));
+            hal.stream.write("]" ASCII_EOL);
+        }
+        return Status_OK;
+    }
+
+    char *end;
+    uint32_t occupied = 0, pocket = strtoul(args, &end, 10);
+
+    if(*end == ',')
+        occupied = strtoul(end + 1, &end, 10);
+
+    if(*end != '\0')
+        return Status_BadNumberFormat;
+
+    if(pocket > n_pockets || occupied > 1)
+        return Status_GcodeValueOutOfRange;
+
+    if(pocket == 0) {
+        memset(occupancy.known, 0, sizeof(occupancy.known));
+        memset(occupancy.occupied, 0, sizeof(occupancy.occupied));
+        store_save(Store_Occupancy);
+    } else
+        occupancy_set(pocket - 1, true, occupied != 0);
+
+    change_plan.valid = false;
 
     return Status_OK;
 }
 
+static const sys_command_t atc_command_list[] = {
+    {"RCTIME", report_timing, { .noargs = On }, { .str = "output RapidChange tool change timing per phase: last|min|mean|max (ms)|syncs, NVS writes|count since startup" } },
+    {"RCTLO", tlo_cache_command, {}, { .str = "output RapidChange stored tool lengths: tool|trigger Z|age|uses, $RCTLO=<tool> invalidates a tool, 0 all" } },
+    {"RCMAP", pocket_map_command, {}, { .str = "output RapidChange dynamic pocket map: pocket|tool, $RCMAP=<pocket>,<tool> assigns a tool, 0 empties the pocket" } },
+    {"RCOCCUPY", occupancy_command, {}, { .str = "output RapidChange pocket occupancy: pocket|0 empty, 1 occupied, 2 unknown, $RCOCCUPY=<pocket>,<0|1> sets a pocket, 0 forgets all" } },
+    {"RCPLAN", plan_command, {}, { .str = "plan RapidChange job tool changes: change|unload tool|load tool|travel (mm)|traverse time (ms), total|traverse time (ms)|travel (mm)|pauses, $RCPLAN=<tool>,<tool>,... then $RCPLAN applies the suggested pockets" } },
+    {"RCTUNE", tune_command, {}, { .str = "output RapidChange engage auto tune: engage|level|feed rate|rpm|engages|failures, $RCTUNE=0 restarts at the settings" } },
+    {"RCPOCKET", pocket_command, {}, { .str = "output RapidChange pockets: pocket|magazine|tool|X,Y|correction X,Y,Z, $RCPOCKET=<pocket>,<x>,<y>,<z> sets the corrections" } },
+};
+
+static sys_commands_t atc_commands = {
+    .n_commands = sizeof(atc_command_list) / sizeof(sys_command_t),
+    .commands = atc_command_list
+};
+
+static sys_commands_t *atc_get_commands (void)
+{
+    return &atc_commands;
+}
+
 // Claim HAL tool change entry points and clear current tool offsets.
 void atc_init (void)
 {
@@ -921,6 +3903,7 @@ void atc_init (void)
 
     ports.tool_recognition = 0xFF;
     ports.dust_cover = 0xFF;
+    ports.dust_cover_feedback = 0xFF;
     bool ok;
     if(!ioport_can_claim_explicit()) {
         if((ok = hal.port.num_digital_in >= 1)) {
@@ -957,17 +3940,38 @@ void atc_init (void)
 
     // If initialization runs a second time, clear TLO
     if (!sys.cold_start) {
-        RAPIDCHANGE_DEBUG_PRINT("Clear TLO.");
+        RAPIDCHANGE_LOG_DEBUG("Clear TLO.");
         gc_set_tool_offset(ToolLengthOffset_Cancel, 0, 0.0f);
     }
 
     on_report_options = grbl.on_report_options;
     grbl.on_report_options = report_options;
 
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = execute_realtime;
+
+    on_realtime_report = grbl.on_realtime_report;
+    grbl.on_realtime_report = realtime_report;
+
+    atc_commands.on_get_commands = grbl.on_get_commands;
+    grbl.on_get_commands = atc_get_commands;
+
     hal.tool.select = tool_select;
     hal.tool.change = tool_change;
 
-    if((nvs_address = nvs_alloc(sizeof(atc_settings_t)))) {
+    if((store[Store_Settings].address = nvs_alloc(sizeof(atc_settings_header_t) + RAPIDCHANGE_SETTINGS_RESERVE))) {
+        if(!(store[Store_TloCache].address = nvs_alloc(sizeof(atc_tlo_cache_block_t))))
+            protocol_enqueue_foreground_task(report_warning, "RapidChange: No NVS storage for tool lengths, stored tool lengths are lost on restart!");
+        if(!(store[Store_PocketCorrection].address = nvs_alloc(sizeof(pocket_correction))))
+            protocol_enqueue_foreground_task(report_warning, "RapidChange: No NVS storage for pocket corrections, corrections are lost on restart!");
+        if(!(store[Store_PocketMap].address = nvs_alloc(sizeof(atc_pocket_map_t))))
+            protocol_enqueue_foreground_task(report_warning, "RapidChange: No NVS storage for the pocket map, the pocket map is lost on restart!");
+        if(!(store[Store_Checkpoint].address = nvs_alloc(sizeof(atc_checkpoint_t))))
+            protocol_enqueue_foreground_task(report_warning, "RapidChange: No NVS storage for the tool change state, the tool in the spindle is lost on restart!");
+        if(!(store[Store_Tune].address = nvs_alloc(sizeof(tune))))
+            protocol_enqueue_foreground_task(report_warning, "RapidChange: No NVS storage for the auto tune, the tuned speeds are lost on restart!");
+        if(!(store[Store_Occupancy].address = nvs_alloc(sizeof(atc_occupancy_t))))
+            protocol_enqueue_foreground_task(report_warning, "RapidChange: No NVS storage for the pocket occupancy, the occupancy is lost on restart!");
         settings_register(&setting_details);
     } else {
         protocol_enqueue_foreground_task(report_warning, "RapidChange: Failed to initialize, no NVS storage for settings!");
@@ -0,0 +1,365 @@
+/*
+  atc_bench.c - Cycle time benchmark of the RapidChange plugin against the mocked grblHAL core
+
+  Part of grblHAL
+
+  Grbl is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Grbl is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Grbl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "mock.h"
+
+// Outcome of a tool change of the corpus, times in ms of the mocked clock and the travel in mm.
+typedef struct {
+    bool ok;
+    uint32_t time;
+    uint16_t syncs;
+    uint16_t ramp_waits;
+    uint32_t ramp_wait_time;
+    uint16_t nvs_writes;
+    float travel;
+} bench_result_t;
+
+typedef struct {
+    const char *name;
+    tool_id_t current_tool;
+    tool_id_t next_tool;
+} bench_change_t;
+
+// Setting of the corpus, unnamed for the default. With tool recognition the sensor reads the unload script,
+// then the load script. The length of the next tool is stored before the change if measured.
+typedef struct {
+    const char *name;
+    void (*setup)(void);
+    const char *unload_sensor;
+    const char *load_sensor;
+    bool measure_next;
+} bench_setting_t;
+
+static void recognition (void)
+{
+    mock_setting(940, 1.0f);
+}
+
+static void dust_cover_axis (void)
+{
+    mock_setting(950, 1.0f);
+    mock_setting(951, A_AXIS_BIT);
+    mock_setting(952, 90.0f);
+    mock_setting(953, 0.0f);
+}
+
+static void dust_cover_port (void)
+{
+    mock_setting(950, 2.0f);
+}
+
+static void far_pockets (void)
+{
+    mock_setting(903, 90.0f);
+}
+
+static void planned_sequence (void)
+{
+    mock_setting(960, 1.0f);
+}
+
+static void direct_traverse (void)
+{
+    mock_setting(906, 1.0f);
+}
+
+static void spindle_traverse (void)
+{
+    mock_setting(963, 1.0f);
+    mock_setting(964, 500.0f);
+}
+
+static void spindle_feedback (void)
+{
+    mock_setting(925, 1.0f);
+    mock.spindle_feedback = true;
+}
+
+static void on_the_fly_recognition (void)
+{
+    mock_setting(940, 1.0f);
+    mock_setting(944, 1.0f);
+}
+
+static void tool_setter (void)
+{
+    mock_setting(930, 1.0f);
+}
+
+// At the set feed rate the re-probe pays off with a clearance of less than the seek retreat.
+static void fast_reprobe (void)
+{
+    mock_setting(930, 1.0f);
+    mock_setting(938, 1.0f);
+    mock_setting(939, 1.0f);
+}
+
+// Tool n is in pocket n of the 6 pockets of the test machine, tool 9 has no pocket.
+static const bench_change_t changes[] = {
+    { "Adjacent swap", 1, 2 },
+    { "Far swap", 1, 6 },
+    { "Load", 0, 1 },
+    { "Unload", 1, 0 },
+    { "Middle load", 0, 3 },
+    { "Middle unload", 3, 0 },
+    { "Far load", 0, 6 },
+    { "Far unload", 6, 0 },
+    { "Manual pocket", 1, 9 }
+};
+
+// In the retry the sensor still sees the tool after the first unload attempt.
+static const bench_setting_t recognition_settings[] = {
+    { NULL },
+    { "recognition", recognition, "00", "10" },
+    { "recognition retry", recognition, "100", "10" }
+};
+
+static const bench_setting_t dust_cover_settings[] = {
+    { NULL },
+    { "dust cover axis", dust_cover_axis },
+    { "dust cover port", dust_cover_port }
+};
+
+static const bench_setting_t pocket_settings[] = {
+    { NULL },
+    { "far pockets", far_pockets }
+};
+
+// Each optimization runs with the default of the settings above, the on the fly recognition reads the tool once per pass.
+static const bench_setting_t optimization_settings[] = {
+    { NULL },
+    { "planned sequence", planned_sequence },
+    { "direct traverse", direct_traverse },
+    { "spindle traverse", spindle_traverse },
+    { "spindle feedback", spindle_feedback },
+    { "on the fly recognition", on_the_fly_recognition, "0", "1" },
+    { "tool setter", tool_setter, NULL, NULL, true },
+    { "fast reprobe", fast_reprobe, NULL, NULL, true }
+};
+
+#define N_ENTRIES(array) (sizeof(array) / sizeof(array[0]))
+#define N_SETTINGS 4
+#define N_MATRIX (N_ENTRIES(recognition_settings) * N_ENTRIES(dust_cover_settings) * N_ENTRIES(pocket_settings))
+#define N_CORPUS (N_ENTRIES(changes) * (N_MATRIX + N_ENTRIES(optimization_settings) - 1))
+
+// Settings of an entry of the corpus, the entries run each change with each combination of the matrix,
+// then with each optimization.
+static const bench_change_t *corpus_entry (size_t entry, const bench_setting_t **settings)
+{
+    size_t config = entry / N_ENTRIES(changes), matrix = config < N_MATRIX ? config : 0;
+
+    settings[0] = &recognition_settings[matrix % N_ENTRIES(recognition_settings)];
+    settings[1] = &dust_cover_settings[matrix / N_ENTRIES(recognition_settings) % N_ENTRIES(dust_cover_settings)];
+    settings[2] = &pocket_settings[matrix / N_ENTRIES(recognition_settings) / N_ENTRIES(dust_cover_settings)];
+    settings[3] = &optimization_settings[config < N_MATRIX ? 0 : config - N_MATRIX + 1];
+
+    return &changes[entry % N_ENTRIES(changes)];
+}
+
+// Run a tool change of the corpus with the settings on a freshly started plugin, the writes deferred till idle are included.
+static bench_result_t run (const bench_change_t *change, const bench_setting_t **settings)
+{
+    static char sensor[16];
+    bench_result_t result = {0};
+    const char *unload_sensor = NULL, *load_sensor = NULL;
+    bool measure_next = false;
+
+    mock_init();
+    mock_machine();
+    for(uint_fast8_t idx = 0; idx < N_SETTINGS; idx++) {
+        if(settings[idx]->setup)
+            settings[idx]->setup();
+        if(settings[idx]->unload_sensor) {
+            unload_sensor = settings[idx]->unload_sensor;
+            load_sensor = settings[idx]->load_sensor;
+        }
+        measure_next |= settings[idx]->measure_next;
+    }
+    mock_settings_save();
+
+    if(measure_next && change->next_tool) {
+        mock.sensor = load_sensor;
+        if(mock_tool_change(change->next_tool) != Status_OK)
+            return result;
+    }
+
+    if(change->current_tool != gc_state.tool->tool_id) {
+        if(unload_sensor) {
+            strcpy(sensor, gc_state.tool->tool_id ? unload_sensor : "");
+            strcat(sensor, load_sensor);
+            mock.sensor = sensor;
+        }
+        if(mock_tool_change(change->current_tool) != Status_OK)
+            return result;
+    }
+
+    mock_poll(1);
+    mock_clear();
+
+    if(unload_sensor) {
+        strcpy(sensor, change->current_tool ? unload_sensor : "");
+        if(change->next_tool && change->next_tool <= 6)
+            strcat(sensor, load_sensor);
+        mock.sensor = sensor;
+    }
+
+    uint32_t start = mock.clock;
+
+    if((result.ok = mock_tool_change(change->next_tool) == Status_OK)) {
+        result.time = mock.clock - start;
+        mock_poll(1);
+        result.syncs = mock.syncs;
+        result.ramp_waits = mock.ramp_waits;
+        result.ramp_wait_time = mock.ramp_wait_time;
+        result.nvs_writes = mock.n_nvs_writes;
+        result.travel = mock.travel;
+    }
+
+    return result;
+}
+
+static void report (const char *name, bench_result_t *result)
+{
+    printf("[RCBENCH:%s|%u|%u|%u|%u|%u|%.1f]\n", name, result->time, result->syncs, result->ramp_waits, result->ramp_wait_time, result->nvs_writes, result->travel);
+}
+
+// Read the result of the named change from a file of report lines, false if not found.
+static bool baseline (FILE *file, const char *name, bench_result_t *result)
+{
+    char line[192], scenario[96];
+    unsigned int time, syncs, ramp_waits, ramp_wait_time, nvs_writes;
+    float travel;
+
+    rewind(file);
+
+    while(fgets(line, sizeof(line), file)) {
+        if(sscanf(line, "[RCBENCH:%95[^|]|%u|%u|%u|%u|%u|%f]", scenario, &time, &syncs, &ramp_waits, &ramp_wait_time, &nvs_writes, &travel) == 7 && !strcmp(scenario, name)) {
+            result->time = time;
+            result->syncs = syncs;
+            result->ramp_waits = ramp_waits;
+            result->ramp_wait_time = ramp_wait_time;
+            result->nvs_writes = nvs_writes;
+            result->travel = travel;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// A change regresses when it takes longer, waits for the planner more often or travels further than the baseline.
+static bool regressed (FILE *file, const char *name, bench_result_t *result)
+{
+    bench_result_t base;
+
+    if(file == NULL)
+        return false;
+
+    if(!baseline(file, name, &base)) {
+        printf("    %s: not in the baseline\n", name);
+        return true;
+    }
+
+    if(result->time > base.time || result->syncs > base.syncs || result->travel > base.travel + 0.05f) {
+        printf("    %s: %u ms, %u syncs, %.1f mm, baseline %u ms, %u syncs, %.1f mm\n", name, result->time, result->syncs, result->travel, base.time, base.syncs, base.travel);
+        return true;
+    }
+
+    return false;
+}
+
+// Each entry of the corpus runs in its own process and reports its result through a pipe. The report lines are compared against the baseline file if given,
+// the output of a run is a new baseline.
+int main (int argc, char **argv)
+{
+    int fd[2], failed = 0;
+    FILE *file = NULL;
+    bench_result_t result, total = { .ok = true };
+
+    if(argc > 1 && (file = fopen(argv[1], "r")) == NULL) {
+        perror(argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    setvbuf(stdout, NULL, _IONBF, 0);
+
+    for(size_t idx = 0; idx < N_CORPUS; idx++) {
+        int status = 1;
+        pid_t pid;
+        char name[96];
+        const bench_setting_t *settings[N_SETTINGS];
+        const bench_change_t *change = corpus_entry(idx, settings);
+
+        strcpy(name, change->name);
+        for(uint_fast8_t setting = 0; setting < N_SETTINGS; setting++) {
+            if(settings[setting]->name) {
+                strcat(name, ", ");
+                strcat(name, settings[setting]->name);
+            }
+        }
+
+        if(pipe(fd))
+            return EXIT_FAILURE;
+
+        if((pid = fork()) == 0) {
+            close(fd[0]);
+            result = run(change, settings);
+            exit(write(fd[1], &result, sizeof(bench_result_t)) == sizeof(bench_result_t) ? 0 : 1);
+        }
+
+        close(fd[1]);
+        memset(&result, 0, sizeof(bench_result_t));
+        if(pid < 0 || read(fd[0], &result, sizeof(bench_result_t)) != sizeof(bench_result_t) ||
+            waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status))
+            result.ok = false;
+        close(fd[0]);
+
+        if(!result.ok) {
+            printf("    %s: tool change failed\n", name);
+            failed++;
+            continue;
+        }
+
+        report(name, &result);
+        if(regressed(file, name, &result))
+            failed++;
+
+        total.time += result.time;
+        total.syncs += result.syncs;
+        total.ramp_waits += result.ramp_waits;
+        total.ramp_wait_time += result.ramp_wait_time;
+        total.nvs_writes += result.nvs_writes;
+        total.travel += result.travel;
+    }
+
+    report("Total", &total);
+    if(!failed && regressed(file, "Total", &total))
+        failed++;
+
+    if(file)
+        fclose(file);
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,706 @@
+/*
+  atc_test.c - Host tests of the RapidChange plugin against the mocked grblHAL core
+
+  Part of grblHAL
+
+  Grbl is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Grbl is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Grbl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "mock.h"
+#include "grbl/motion_control.h"
+
+// Pockets of the test machine, see mock_machine()
+#define POCKET_X(pocket) (100.0f + 45.0f * ((pocket) - 1))
+#define POCKET_Y 50.0f
+#define Z_ENGAGE -80.0f
+#define Z_START (Z_ENGAGE + 23.0f)
+#define Z_RETRACT (Z_ENGAGE + 13.0f)
+
+// NVS blocks in the order allocated by the plugin
+#define BLOCK_SETTINGS   0
+#define BLOCK_CORRECTION 2
+#define BLOCK_CHECKPOINT 4
+
+static int failures;
+
+#define CHECK(condition) do { if(!(condition)) { printf("    %s:%d: %s\n", __FILE__, __LINE__, #condition); failures++; } } while(0)
+
+static void dump (void)
+{
+    for(uint_fast16_t idx = 0; idx < mock.n_moves; idx++)
+        printf("    %s X%.3f Y%.3f Z%.3f F%.0f %u-%u\n", mock.move[idx].type == Move_Rapid ? "G0" : mock.move[idx].type == Move_Feed ? "G1" : "G38",
+                mock.move[idx].target.x, mock.move[idx].target.y, mock.move[idx].target.z, mock.move[idx].feed_rate, mock.move[idx].start, mock.move[idx].end);
+    for(uint_fast8_t idx = 0; idx < mock.n_spindle; idx++)
+        printf("    spindle %s %.0f at %u\n", mock.spindle[idx].state.on ? (mock.spindle[idx].state.ccw ? "CCW" : "CW") : "off", mock.spindle[idx].rpm, mock.spindle[idx].time);
+    printf("    clock %u syncs %u holds %u sensor reads %u warning %s\n", mock.clock, mock.syncs, mock.holds, mock.sensor_reads, mock.last_warning ? mock.last_warning : "-");
+}
+
+static bool at_pocket (const mock_move_t *move, uint_fast8_t pocket)
+{
+    return move && move->target.x == POCKET_X(pocket) && move->target.y == POCKET_Y;
+}
+
+// Index of the first spindle change to the given state, -1 if none.
+static int spindle_change (bool on, bool ccw)
+{
+    for(uint_fast8_t idx = 0; idx < mock.n_spindle; idx++) {
+        if(mock.spindle[idx].state.on == on && (!on || mock.spindle[idx].state.ccw == ccw))
+            return idx;
+    }
+
+    return -1;
+}
+
+static uint_fast16_t count_moves (mock_move_type_t type, int axis, float position)
+{
+    uint_fast16_t count = 0;
+
+    for(uint_fast16_t idx = 0; idx < mock.n_moves; idx++) {
+        if(mock.move[idx].type == type && fabsf(mock.move[idx].target.values[axis] - position) < 0.001f)
+            count++;
+    }
+
+    return count;
+}
+
+// Loading into the empty spindle plunges twice into pocket 2 with the spindle running forward,
+// then stops the spindle and returns to the start position. Without ramp wait times the plunge starts at once.
+static void test_load (void)
+{
+    CHECK(mock_tool_change(2) == Status_OK);
+
+    const mock_move_t *engage = mock_find_move(Move_Feed, Z_AXIS, Z_ENGAGE), *last = &mock.move[mock.n_moves - 1];
+    int cw = spindle_change(true, false), stop = spindle_change(false, false);
+
+    CHECK(at_pocket(engage, 2));
+    CHECK(count_moves(Move_Feed, Z_AXIS, Z_ENGAGE) == 2);
+    CHECK(cw == 0 && mock.spindle[cw].rpm == 1200.0f && mock.spindle[cw].time <= engage->start);
+    CHECK(stop > cw);
+    CHECK(spindle_change(true, true) == -1);
+    CHECK(last->target.x == 0.0f && last->target.y == 0.0f && last->target.z == 0.0f);
+    CHECK(mock.ramp_waits == 0);
+    CHECK(gc_state.tool->tool_id == 2);
+}
+
+// The ramp wait times are waited in full without speed feedback.
+static void test_ramp_wait (void)
+{
+    mock_setting(923, 2000.0f);
+    mock_settings_save();
+
+    CHECK(mock_tool_change(2) == Status_OK);
+    CHECK(mock.ramp_waits == 2 && mock.ramp_wait_time >= 4000);
+}
+
+// With speed feedback the spindle is waited for till at speed, regardless of the ramp wait times.
+static void test_spindle_feedback (void)
+{
+    mock_setting(923, 5000.0f);
+    mock_setting(925, 1.0f);
+    mock_settings_save();
+    mock.spindle_feedback = true;
+
+    CHECK(mock_tool_change(2) == Status_OK);
+    CHECK(mock.ramp_waits == 2 && mock.ramp_wait_time >= MOCK_SPINDLE_RAMP && mock.ramp_wait_time < 2 * MOCK_SPINDLE_RAMP);
+
+    mock_setting(923, 0.0f);
+    mock_settings_save();
+    mock_clear();
+
+    CHECK(mock_tool_change(5) == Status_OK);
+    CHECK(mock.ramp_waits == 4 && mock.ramp_wait_time >= 2 * MOCK_SPINDLE_RAMP);
+}
+
+// A swap unloads to the pocket of the current tool in reverse before loading the next tool.
+static void test_swap (void)
+{
+    CHECK(mock_tool_change(2) == Status_OK);
+    mock_clear();
+    CHECK(mock_tool_change(5) == Status_OK);
+
+    int ccw = spindle_change(true, true), cw = spindle_change(true, false);
+    const mock_move_t *unload = mock_find_move(Move_Feed, Z_AXIS, Z_ENGAGE), *load = NULL;
+
+    for(uint_fast16_t idx = 0; idx < mock.n_moves; idx++) {
+        if(mock.move[idx].type == Move_Feed && at_pocket(&mock.move[idx], 5)) {
+            load = &mock.move[idx];
+            break;
+        }
+    }
+
+    CHECK(at_pocket(unload, 2));
+    CHECK(load != NULL && load->target.z == Z_ENGAGE);
+    CHECK(ccw >= 0 && cw > ccw);
+    CHECK(mock.spindle[ccw].time <= unload->start && load && mock.spindle[cw].time <= load->start);
+    CHECK(gc_state.tool->tool_id == 5);
+}
+
+// Unloading to tool 0 does not start the spindle forward.
+static void test_unload (void)
+{
+    CHECK(mock_tool_change(2) == Status_OK);
+    mock_clear();
+    CHECK(mock_tool_change(0) == Status_OK);
+
+    CHECK(at_pocket(mock_find_move(Move_Feed, Z_AXIS, Z_ENGAGE), 2));
+    CHECK(spindle_change(true, true) == 0);
+    CHECK(spindle_change(true, false) == -1);
+    CHECK(gc_state.tool->tool_id == 0);
+}
+
+// A tool without a pocket is loaded manually, the change pauses with a feed hold.
+static void test_manual_pocket (void)
+{
+    CHECK(mock_tool_change(9) == Status_OK);
+
+    CHECK(mock.holds == 1);
+    CHECK(mock.last_warning && strstr(mock.last_warning, "does not have an assigned pocket"));
+    CHECK(mock_find_move(Move_Feed, Z_AXIS, Z_ENGAGE) == NULL);
+    CHECK(mock.n_spindle == 0);
+}
+
+// With dynamic pockets a tool without pocket is unloaded to the empty pocket on the shortest way to the load pocket,
+// chosen from the position at M6 rather than at the tool select before the machine moved on.
+static void test_dynamic_unload (void)
+{
+    static tool_data_t next_tool;
+    plan_line_data_t plan_data;
+    float target[N_AXIS] = { 300.0f, POCKET_Y, 0.0f };
+
+    CHECK(mock_setting(962, 1.0f));
+    CHECK(mock_command("RCMAP", "1,0") == Status_OK);
+    CHECK(mock_command("RCMAP", "5,0") == Status_OK);
+    CHECK(mock_tool_change(9) == Status_OK);
+    mock_clear();
+
+    next_tool.tool_id = 3;
+    hal.tool.select(&next_tool, true);
+    plan_data_init(&plan_data);
+    plan_data.condition.rapid_motion = true;
+    CHECK(mc_line(target, &plan_data));
+    CHECK(hal.tool.change(&gc_state) == Status_OK);
+
+    CHECK(at_pocket(mock_find_move(Move_Feed, Z_AXIS, Z_ENGAGE), 5));
+    CHECK(mock_find_move(Move_Rapid, X_AXIS, POCKET_X(1)) == NULL);
+    CHECK(mock.syncs == 18);
+}
+
+// With tool recognition a tool still sensed after the unload is unloaded again, then the change continues.
+static void test_recognition_retry (void)
+{
+    mock_setting(940, 1.0f);
+    mock_settings_save();
+
+    mock.sensor = "10";
+    CHECK(mock_tool_change(2) == Status_OK);
+    CHECK(mock.holds == 0);
+
+    mock_clear();
+    mock.sensor = "1" "00" "10";
+    CHECK(mock_tool_change(5) == Status_OK);
+
+    CHECK(mock.holds == 0);
+    CHECK(count_moves(Move_Feed, Z_AXIS, Z_ENGAGE) >= 4);
+    CHECK(gc_state.tool->tool_id == 5);
+}
+
+// The first measurement sets the tool length reference, the next one a dynamic offset of the length difference.
+static void test_tool_setter (void)
+{
+    mock_setting(930, 1.0f);
+    mock_settings_save();
+
+    CHECK(mock_tool_change(2) == Status_OK);
+    CHECK(mock.probes >= 1);
+    CHECK(mock_find_move(Move_Rapid, X_AXIS, 10.0f) != NULL);
+    CHECK(sys.tlo_reference_set.mask != 0);
+
+    mock_clear();
+    mock.probe_z = -28.0f;
+    CHECK(mock_tool_change(5) == Status_OK);
+    CHECK(mock.probes >= 1);
+    CHECK(mock.tlo_mode == ToolLengthOffset_EnableDynamic);
+    CHECK(mock.tlo == 200);
+}
+
+// Seat detection ends the plunge once the spindle slows down, the nut seated in the window is not engaged again.
+// The plunge queued ahead travels less than 2 mm past the seat at the engage feed rate.
+static void test_seat_detection (void)
+{
+    mock_setting(925, 1.0f);
+    mock_setting(966, 1.0f);
+    mock_settings_save();
+    mock.spindle_feedback = true;
+    mock.seat_z = Z_ENGAGE + 2.5f;
+
+    CHECK(mock_tool_change(2) == Status_OK);
+
+    CHECK(mock_find_move(Move_Feed, Z_AXIS, Z_START - 1.0f) != NULL);
+    CHECK(mock_find_move(Move_Feed, Z_AXIS, Z_ENGAGE) == NULL);
+    CHECK(mock_find_move(Move_Rapid, Z_AXIS, Z_RETRACT) == NULL);
+    CHECK(mock.holds == 0);
+}
+
+// Time of the first plunge from the start of its first feed move till it reaches the engage position.
+static uint32_t plunge_time (void)
+{
+    const mock_move_t *start = NULL;
+
+    for(uint_fast16_t idx = 0; idx < mock.n_moves; idx++) {
+        if(mock.move[idx].type != Move_Feed)
+            continue;
+        if(start == NULL)
+            start = &mock.move[idx];
+        if(mock.move[idx].target.z == Z_ENGAGE)
+            return mock.move[idx].end - start->start;
+    }
+
+    return 0;
+}
+
+// The plunge of the seat detection is queued ahead so it runs at the feed rate like a single move if the nut does not seat.
+static void test_seat_plunge (void)
+{
+    uint32_t single;
+
+    mock_setting(925, 1.0f);
+    mock_settings_save();
+    mock.spindle_feedback = true;
+    mock.seat_z = Z_ENGAGE - 10.0f;
+
+    CHECK(mock_tool_change(2) == Status_OK);
+    single = plunge_time();
+    CHECK(mock_tool_change(0) == Status_OK);
+
+    mock_setting(966, 1.0f);
+    mock_settings_save();
+    mock_clear();
+    CHECK(mock_tool_change(2) == Status_OK);
+
+    CHECK(mock_find_move(Move_Feed, Z_AXIS, Z_START - 1.0f) != NULL);
+    CHECK(single > 0 && plunge_time() >= single && plunge_time() <= single + 10);
+}
+
+// A nut seating before the window is cross-threaded and loaded manually.
+static void test_seat_early (void)
+{
+    mock_setting(925, 1.0f);
+    mock_setting(966, 1.0f);
+    mock_settings_save();
+    mock.spindle_feedback = true;
+    mock.seat_z = Z_ENGAGE + 10.0f;
+
+    CHECK(mock_tool_change(2) == Status_OK);
+
+    CHECK(mock_find_move(Move_Feed, Z_AXIS, Z_ENGAGE) == NULL);
+    CHECK(mock.holds == 1);
+    CHECK(mock.last_warning && strstr(mock.last_warning, "thread"));
+}
+
+// Without seat detection the plunge is a single move, regardless of the spindle speed feedback.
+static void test_seat_detection_disabled (void)
+{
+    mock_setting(925, 1.0f);
+    mock_settings_save();
+    mock.spindle_feedback = true;
+    mock.seat_z = Z_ENGAGE + 1.0f;
+
+    CHECK(mock_tool_change(2) == Status_OK);
+
+    CHECK(mock_find_move(Move_Feed, Z_AXIS, Z_START - 1.0f) == NULL);
+    CHECK(count_moves(Move_Feed, Z_AXIS, Z_ENGAGE) == 2);
+}
+
+// The planned sequence only waits for the motion at the barriers, the swap moves through the same pockets.
+static void test_planned_sequence (void)
+{
+    mock_setting(960, 1.0f);
+    mock_settings_save();
+
+    CHECK(mock_tool_change(2) == Status_OK);
+    mock_clear();
+    CHECK(mock_tool_change(5) == Status_OK);
+
+    CHECK(at_pocket(mock_find_move(Move_Feed, Z_AXIS, Z_ENGAGE), 2));
+    CHECK(count_moves(Move_Feed, Z_AXIS, Z_ENGAGE) == 3);
+    CHECK(gc_state.tool->tool_id == 5);
+    CHECK(mock.syncs == 9);
+}
+
+// The direct traverse keeps the traverse height from the unload pocket till one pocket before the load pocket.
+static void test_direct_traverse (void)
+{
+    mock_setting(906, 1.0f);
+    mock_settings_save();
+
+    CHECK(mock_tool_change(2) == Status_OK);
+    mock_clear();
+    CHECK(mock_tool_change(5) == Status_OK);
+
+    const mock_move_t *via = mock_find_move(Move_Rapid, X_AXIS, POCKET_X(4));
+
+    CHECK(via && via->target.z == Z_ENGAGE + 40.0f);
+    CHECK(via && via[-1].target.x == POCKET_X(2) && via[-1].target.z == Z_ENGAGE + 40.0f);
+    CHECK(via && via[1].target.x == POCKET_X(5) && via[1].target.z == Z_START);
+    CHECK(mock.syncs == 17);
+}
+
+// A pocket known to be empty pauses for a manual load before moving into the magazine.
+static void test_occupancy_check (void)
+{
+    mock_setting(965, 1.0f);
+    mock_settings_save();
+    CHECK(mock_command("RCOCCUPY", "2,0") == Status_OK);
+
+    CHECK(mock_tool_change(2) == Status_OK);
+
+    CHECK(mock.holds == 1);
+    CHECK(mock.last_warning && strstr(mock.last_warning, "empty"));
+    CHECK(mock_find_move(Move_Rapid, X_AXIS, POCKET_X(2)) == NULL);
+    CHECK(mock.n_spindle == 0);
+    CHECK(mock.syncs == 9);
+}
+
+// A tool measured in this session is loaded again with the stored length, without moving to the tool setter.
+static void test_tool_length_cache (void)
+{
+    mock_setting(930, 1.0f);
+    mock_setting(970, 1.0f);
+    mock_settings_save();
+
+    CHECK(mock_tool_change(2) == Status_OK);
+    CHECK(mock.probes >= 1);
+    CHECK(mock_tool_change(0) == Status_OK);
+    mock_clear();
+    CHECK(mock_tool_change(2) == Status_OK);
+
+    CHECK(mock.probes == 0);
+    CHECK(mock_find_move(Move_Rapid, X_AXIS, 10.0f) == NULL);
+    CHECK(mock.tlo_mode == ToolLengthOffset_EnableDynamic && mock.tlo == 0);
+    CHECK(mock.syncs == 13);
+}
+
+// Auto tune raises the engage feed rate by a level once a window of engages was confirmed by the tool recognition.
+static void test_engage_tune (void)
+{
+    mock_setting(926, 1.0f);
+    mock_setting(940, 1.0f);
+    mock_settings_save();
+
+    mock.sensor = "10" "0010" "0010" "0010" "0010" "0010" "0010" "0010" "0010" "0010" "0010";
+    CHECK(mock_tool_change(2) == Status_OK);
+    for(uint_fast8_t idx = 0; idx < 10; idx++) {
+        CHECK(mock_tool_change(0) == Status_OK);
+        CHECK(mock_tool_change(2) == Status_OK);
+    }
+    CHECK(mock.holds == 0);
+
+    mock_clear();
+    mock.sensor = "00";
+    CHECK(mock_tool_change(0) == Status_OK);
+
+    const mock_move_t *unload = mock_find_move(Move_Feed, Z_AXIS, Z_ENGAGE);
+
+    CHECK(unload && unload->feed_rate == 1800.0f + (3000.0f - 1800.0f) / 10.0f);
+    CHECK(mock.syncs == 12);
+}
+
+// On the fly the tool is recognized from the IR beam changes while moving, the unload retracts to the traverse
+// height without stopping in zone 1.
+static void test_recognition_on_the_fly (void)
+{
+    mock_setting(940, 1.0f);
+    mock_setting(944, 1.0f);
+    mock_settings_save();
+
+    mock.sensor = "1" "0" "1";
+    CHECK(mock_tool_change(2) == Status_OK);
+    mock_clear();
+    CHECK(mock_tool_change(5) == Status_OK);
+
+    const mock_move_t *unload = mock_find_move(Move_Feed, Z_AXIS, Z_ENGAGE);
+
+    CHECK(mock.holds == 0);
+    CHECK(at_pocket(unload, 2) && unload[1].target.z == Z_ENGAGE + 40.0f);
+    CHECK(mock.sensor_reads == 2);
+    CHECK(gc_state.tool->tool_id == 5);
+    CHECK(mock.syncs == 19);
+}
+
+// With the spindle running on the traverse the spindle reverses at the unload pocket and runs till the load is done.
+static void test_spindle_traverse (void)
+{
+    mock_setting(963, 1.0f);
+    mock_setting(964, 500.0f);
+    mock_settings_save();
+
+    CHECK(mock_tool_change(2) == Status_OK);
+    mock_clear();
+    CHECK(mock_tool_change(5) == Status_OK);
+
+    int ccw = spindle_change(true, true), cw = spindle_change(true, false), stop = spindle_change(false, false);
+    const mock_move_t *traverse = mock_find_move(Move_Rapid, X_AXIS, POCKET_X(5));
+
+    CHECK(ccw == 0 && cw == 1 && stop == 2);
+    CHECK(traverse && mock.spindle[cw].time <= traverse->start);
+    CHECK(mock.syncs == 18);
+}
+
+// The manual change parks the spindle and rises to the safe clearance on cycle start.
+static void test_park (void)
+{
+    mock_setting(916, 1.0f);
+    mock_setting(917, 400.0f);
+    mock_setting(918, 10.0f);
+    mock_setting(919, -20.0f);
+    mock_settings_save();
+
+    CHECK(mock_tool_change(9) == Status_OK);
+
+    const mock_move_t *park = mock_find_move(Move_Rapid, Z_AXIS, -20.0f);
+
+    CHECK(mock.holds == 1);
+    CHECK(park && park->target.x == 400.0f && park->target.y == 10.0f);
+    CHECK(park && park[1].target.x == 400.0f && park[1].target.z == -5.0f && park[1].start >= park->end);
+    CHECK(mock.syncs == 8);
+}
+
+// A magazine loaded along Y plunges along Y at the pocket X and leaves along Y before the climb.
+static void test_side_loading (void)
+{
+    mock_setting(908, Y_AXIS_BIT);
+    mock_settings_save();
+
+    CHECK(mock_tool_change(2) == Status_OK);
+
+    const mock_move_t *engage = mock_find_move(Move_Feed, Y_AXIS, POCKET_Y + Z_ENGAGE);
+
+    CHECK(engage && engage->target.x == POCKET_X(2) && engage[-1].target.y == POCKET_Y + Z_START);
+    CHECK(engage && engage[-1].target.z == engage->target.z);
+    CHECK(count_moves(Move_Feed, Y_AXIS, POCKET_Y + Z_ENGAGE) == 2);
+    CHECK(engage && engage[3].target.y == POCKET_Y + Z_ENGAGE + 40.0f && engage[3].target.z == engage->target.z);
+    CHECK(engage && engage[4].target.z == -5.0f);
+    CHECK(mock.syncs == 13);
+}
+
+// An interrupted change resumes with setting the tool length of the loaded tool, without moving to the pockets again.
+static void test_checkpoint_resume (void)
+{
+    mock_setting(930, 1.0f);
+    mock_setting(960, 1.0f);
+    mock_settings_save();
+    mock.abort_at = mock.clock + 9000;
+
+    CHECK(mock_tool_change(2) != Status_OK);
+    CHECK(mock.resets == 1);
+
+    tool_id_t tool_id;
+    memcpy(&tool_id, mock_nvs(mock.block[BLOCK_CHECKPOINT]), sizeof(tool_id_t));
+    CHECK(tool_id == 2);
+
+    sys.abort = false;
+    mock.abort_at = 0;
+    mock_clear();
+    CHECK(mock_tool_change(2) == Status_OK);
+
+    CHECK(mock.probes >= 1);
+    CHECK(mock_find_move(Move_Rapid, X_AXIS, POCKET_X(2)) == NULL);
+    CHECK(mock.n_spindle == 0);
+    CHECK(mock.syncs == 7);
+}
+
+// The checkpoint is written during the change, the settings are only written when idle.
+static void test_checkpoint (void)
+{
+    mock_clear();
+    CHECK(mock_tool_change(2) == Status_OK);
+
+    CHECK(mock_block_writes(BLOCK_CHECKPOINT) >= 1);
+    CHECK(mock_block_writes(BLOCK_SETTINGS) == 0);
+}
+
+// A reset during the change does not write NVS from the reset handler,
+// the checkpoint written after the unload records the empty spindle.
+static void test_reset (void)
+{
+    CHECK(mock_tool_change(2) == Status_OK);
+    mock_clear();
+    mock.abort_at = mock.clock + 5000;
+
+    CHECK(mock_tool_change(5) != Status_OK);
+    CHECK(mock.resets == 1);
+    CHECK(mock.reset_writes == 0);
+    CHECK(mock_block_writes(BLOCK_CHECKPOINT) >= 1);
+
+    tool_id_t tool_id;
+    memcpy(&tool_id, mock_nvs(mock.block[BLOCK_CHECKPOINT]), sizeof(tool_id_t));
+    CHECK(tool_id == 0);
+}
+
+// The dust cover feedback cannot use the tool recognition port, an out of range port takes the default.
+static void test_feedback_port (void)
+{
+    mock_setting(950, 2.0f);
+    mock_setting(956, 1.0f);
+    mock_setting(957, MOCK_IN_PORTS - 1);
+    mock_settings_save();
+    mock_restart();
+    CHECK(mock.warnings == 1);
+
+    mock_setting(957, MOCK_IN_PORTS + 2);
+    mock_settings_save();
+    mock_restart();
+    CHECK(mock.warnings == 0);
+    CHECK(mock_setting_value(957) == MOCK_IN_PORTS - 2);
+}
+
+// Settings stored with another number of magazines are not read, the defaults are used instead.
+static void test_settings_magazines (void)
+{
+    mock_restart();
+    CHECK(mock_setting_value(902) == 6.0f);
+
+    mock_nvs(mock.block[BLOCK_SETTINGS])[1]++;
+    mock_restart();
+    CHECK(mock_setting_value(902) == 0.0f);
+}
+
+// Restoring the default settings keeps the pocket corrections for the pockets set up again.
+static void test_settings_restore (void)
+{
+    CHECK(mock_command("RCPOCKET", "2,0.5,0,0") == Status_OK);
+    mock_poll(1);
+    mock_clear();
+
+    mock.details->restore();
+    mock_poll(1);
+
+    CHECK(mock_block_writes(BLOCK_SETTINGS) >= 1);
+    CHECK(mock_block_writes(BLOCK_CORRECTION) == 0);
+
+    mock_machine();
+    CHECK(mock_command("RCPOCKET", NULL) == Status_OK);
+    CHECK(strstr(mock.output, "[RCPOCKET:2|1|2|145.500,50.000|0.500,0.000,0.000]") != NULL);
+}
+
+// Pockets not fitting the pocket table or holding tool numbers above RAPIDCHANGE_MAX_TOOLS are rejected by the settings.
+static void test_pocket_limit (void)
+{
+    CHECK(!mock_setting(902, 33.0f));
+    CHECK(mock_setting(902, 20.0f));
+    CHECK(!mock_setting(982, 13.0f));
+    CHECK(mock_setting(982, 12.0f));
+    CHECK(!mock_setting(986, 22.0f));
+    CHECK(mock_setting(986, 21.0f));
+    CHECK(mock_setting(986, 0.0f));
+    CHECK(!mock_setting(907, 2.0f));
+    CHECK(mock_setting_value(902) == 20.0f && mock_setting_value(982) == 12.0f && mock_setting_value(907) == 1.0f);
+
+    mock_settings_save();
+    CHECK(mock.warnings == 0);
+}
+
+// The job plan reports the traverse between the pockets of each change, the time of the traverse
+// is estimated from the rate and the acceleration of the axes at 83.3 mm/s and 500 mm/s^2.
+static void test_plan (void)
+{
+    CHECK(mock_command("RCPLAN", "2,5") == Status_OK);
+    CHECK(strstr(mock.output, "[RCPLAN:1|0|2|153.4|1906]") != NULL);
+    CHECK(strstr(mock.output, "[RCPLAN:2|2|5|135.0|1786]") != NULL);
+    CHECK(strstr(mock.output, "[RCPLAN:Total|3692|288.4|0]") != NULL);
+
+    CHECK(mock_tool_change(2) == Status_OK);
+    mock_clear();
+    CHECK(mock_command("RCPLAN", "9") == Status_OK);
+    CHECK(strstr(mock.output, "[RCPLAN:Total|0|") == NULL);
+    CHECK(strstr(mock.output, "|1]") != NULL);
+}
+
+typedef struct {
+    const char *name;
+    void (*run)(void);
+} test_t;
+
+static const test_t tests[] = {
+    { "load", test_load },
+    { "ramp wait", test_ramp_wait },
+    { "spindle feedback", test_spindle_feedback },
+    { "swap", test_swap },
+    { "unload", test_unload },
+    { "manual pocket", test_manual_pocket },
+    { "dynamic unload", test_dynamic_unload },
+    { "recognition retry", test_recognition_retry },
+    { "tool setter", test_tool_setter },
+    { "seat detection", test_seat_detection },
+    { "seat early", test_seat_early },
+    { "seat plunge", test_seat_plunge },
+    { "seat detection disabled", test_seat_detection_disabled },
+    { "planned sequence", test_planned_sequence },
+    { "direct traverse", test_direct_traverse },
+    { "occupancy check", test_occupancy_check },
+    { "tool length cache", test_tool_length_cache },
+    { "engage tune", test_engage_tune },
+    { "recognition on the fly", test_recognition_on_the_fly },
+    { "spindle traverse", test_spindle_traverse },
+    { "park", test_park },
+    { "side loading", test_side_loading },
+    { "checkpoint", test_checkpoint },
+    { "checkpoint resume", test_checkpoint_resume },
+    { "reset", test_reset },
+    { "feedback port", test_feedback_port },
+    { "settings magazines", test_settings_magazines },
+    { "settings restore", test_settings_restore },
+    { "pocket limit", test_pocket_limit },
+    { "plan", test_plan }
+};
+
+// Each test runs in its own process on a freshly started plugin, a test is selected by name.
+// The recorded moves are printed when a test fails or DUMP is set in the environment.
+int main (int argc, char **argv)
+{
+    int failed = 0;
+
+    setvbuf(stdout, NULL, _IONBF, 0);
+
+    for(size_t idx = 0; idx < sizeof(tests) / sizeof(test_t); idx++) {
+        int status = 1;
+        pid_t pid;
+
+        if(argc > 1 && strcmp(argv[1], tests[idx].name))
+            continue;
+
+        if((pid = fork()) == 0) {
+            mock_init();
+            mock_machine();
+            tests[idx].run();
+            if(failures || getenv("DUMP"))
+                dump();
+            exit(failures ? 1 : 0);
+        }
+
+        if(pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status)) {
+            printf("FAIL %s\n", tests[idx].name);
+            failed++;
+        } else
+            printf("ok   %s\n", tests[idx].name);
+    }
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,571 @@
+/*
+  hal.h - Subset of the grblHAL core API used by the RapidChange plugin, for the host tests
+
+  Part of grblHAL
+
+  Grbl is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Grbl is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Grbl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _HAL_H_
+#define _HAL_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <math.h>
+
+// The A axis drives the dust cover of the axis mode.
+#define N_AXIS 4
+#define X_AXIS 0
+#define Y_AXIS 1
+#define Z_AXIS 2
+#define A_AXIS 3
+#define X_AXIS_BIT bit(X_AXIS)
+#define Y_AXIS_BIT bit(Y_AXIS)
+#define Z_AXIS_BIT bit(Z_AXIS)
+#define A_AXIS_BIT bit(A_AXIS)
+
+#define On 1
+#define Off 0
+#define ASCII_EOL "\r\n"
+#define bit(n) (1UL << (n))
+
+#define ABORTED (sys.abort || sys.cancel)
+
+#define DEFAULT_TOOLCHANGE_SEEK_RATE 200.0f
+#define DEFAULT_TOOLCHANGE_FEED_RATE 25.0f
+#define DEFAULT_TOOLCHANGE_PROBING_DISTANCE 30
+
+#define EXEC_CYCLE_START    bit(1)
+#define EXEC_FEED_HOLD      bit(3)
+#define EXEC_MOTION_CANCEL  bit(7)
+
+#define STATE_IDLE          0
+#define STATE_ALARM         bit(0)
+#define STATE_CYCLE         bit(3)
+#define STATE_HOLD          bit(4)
+#define STATE_TOOL_CHANGE   bit(8)
+
+typedef uint_fast16_t sys_state_t;
+typedef uint32_t tool_id_t;
+typedef uint32_t nvs_address_t;
+typedef uint16_t setting_id_t;
+
+typedef enum {
+    Status_OK = 0,
+    Status_BadNumberFormat = 2,
+    Status_InvalidStatement = 3,
+    Status_IdleError = 8,
+    Status_SettingDisabled = 12,
+    Status_GCodeToolError = 26,
+    Status_GcodeValueOutOfRange = 28,
+    Status_HomingRequired = 45,
+    Status_NVSWriteFailed = 70,
+    Status_Unhandled = 84
+} status_code_t;
+
+typedef union {
+    float values[N_AXIS];
+    struct {
+        float x, y, z, a;
+    };
+} coord_data_t;
+
+typedef struct {
+    float offset[N_AXIS];
+    float radius;
+    tool_id_t tool_id;
+} tool_data_t;
+
+// Spindle
+
+typedef union {
+    uint8_t value;
+    struct {
+        uint8_t on               :1,
+                ccw              :1,
+                pwm              :1,
+                reserved         :1,
+                override_disable :1,
+                encoder_error    :1,
+                at_speed         :1,
+                synchronized     :1;
+    };
+} spindle_state_t;
+
+typedef union {
+    uint16_t value;
+    struct {
+        uint16_t variable        :1,
+                 direction       :1,
+                 at_speed        :1,
+                 laser           :1,
+                 pwm_invert      :1,
+                 pid             :1,
+                 torch           :1,
+                 gpio_controlled :1,
+                 cmd_controlled  :1;
+    };
+} spindle_cap_t;
+
+typedef enum {
+    SpindleData_Counters,
+    SpindleData_RPM,
+    SpindleData_AngularPosition,
+    SpindleData_AtSpeed
+} spindle_data_request_t;
+
+typedef struct {
+    float rpm;
+    float rpm_low_limit;
+    float rpm_high_limit;
+    float angular_position;
+    uint32_t index_count;
+    uint32_t pulse_count;
+    uint32_t error_count;
+    spindle_state_t state_programmed;
+} spindle_data_t;
+
+typedef struct spindle_ptrs spindle_ptrs_t;
+
+struct spindle_ptrs {
+    uint8_t id;
+    spindle_cap_t cap;
+    float rpm_min;
+    float rpm_max;
+    void (*set_state)(spindle_ptrs_t *spindle, spindle_state_t state, float rpm);
+    spindle_state_t (*get_state)(spindle_ptrs_t *spindle);
+    spindle_data_t *(*get_data)(spindle_data_request_t request);
+};
+
+typedef union {
+    uint8_t value;
+    struct {
+        uint8_t flood :1,
+                mist  :1;
+    };
+} coolant_state_t;
+
+// Planner and parser
+
+typedef struct {
+    uint8_t rapid_motion         :1,
+            system_motion        :1,
+            jog_motion           :1,
+            no_feed_override     :1,
+            inverse_time         :1,
+            is_rpm_rate_adjusted :1,
+            is_laser_ppi_mode    :1,
+            target_validated     :1;
+} planner_cond_t;
+
+typedef struct {
+    spindle_ptrs_t *hal;
+    float rpm;
+    spindle_state_t state;
+} plan_spindle_t;
+
+typedef struct {
+    float feed_rate;
+    float rate_multiplier;
+    plan_spindle_t spindle;
+    planner_cond_t condition;
+    uint32_t line_number;
+} plan_line_data_t;
+
+typedef union {
+    uint32_t value;
+    struct {
+        uint32_t jog_motion        :1,
+                 canned_cycle_change :1,
+                 arc_is_clockwise  :1,
+                 probe_is_away     :1,
+                 probe_is_no_error :1;
+    };
+} gc_parser_flags_t;
+
+typedef enum {
+    GCProbe_Found = 0,
+    GCProbe_Abort,
+    GCProbe_FailInit,
+    GCProbe_FailEnd
+} gc_probe_t;
+
+typedef enum {
+    ToolLengthOffset_Cancel = 0,
+    ToolLengthOffset_Enable,
+    ToolLengthOffset_EnableDynamic,
+    ToolLengthOffset_ApplyAdditional
+} tool_offset_mode_t;
+
+typedef union {
+    uint8_t mask;
+} axes_signals_t;
+
+typedef struct {
+    spindle_state_t state;
+} spindle_modal_t;
+
+typedef struct {
+    coolant_state_t coolant;
+    spindle_modal_t spindle;
+} gc_modal_t;
+
+typedef struct {
+    float rpm;
+} gc_spindle_t;
+
+typedef struct parser_state {
+    gc_modal_t modal;
+    gc_spindle_t spindle;
+    tool_data_t *tool;
+    tool_id_t tool_pending;
+} parser_state_t;
+
+extern parser_state_t gc_state;
+
+// System
+
+typedef struct {
+    bool abort;
+    bool cancel;
+    bool cold_start;
+    bool suspend;
+    axes_signals_t homed;
+    axes_signals_t tlo_reference_set;
+    int32_t position[N_AXIS];
+    int32_t probe_position[N_AXIS];
+    int32_t tlo_reference[N_AXIS];
+    volatile uint_fast16_t rt_exec_state;
+} system_t;
+
+extern system_t sys;
+
+// Settings
+
+typedef struct {
+    float at_speed_tolerance;
+} spindle_settings_t;
+
+typedef struct {
+    float steps_per_mm;
+    float max_rate;
+    float acceleration;
+    float max_travel;
+} axis_settings_t;
+
+typedef struct {
+    struct {
+        uint8_t no_restore_position_after_M6 :1;
+    } flags;
+    float junction_deviation;
+    spindle_settings_t spindle;
+    axis_settings_t axis[N_AXIS];
+} settings_t;
+
+extern settings_t settings;
+
+typedef enum {
+    Group_Root = 0,
+    Group_AuxPorts = 38,
+    Group_UserSettings = 40
+} setting_group_t;
+
+typedef enum {
+    Format_Bool = 0,
+    Format_Bitfield,
+    Format_XBitfield,
+    Format_RadioButtons,
+    Format_AxisMask,
+    Format_Integer,
+    Format_Decimal,
+    Format_String,
+    Format_Password,
+    Format_IPv4,
+    Format_Int8,
+    Format_Int16
+} setting_datatype_t;
+
+typedef enum {
+    Setting_NonCore = 0,
+    Setting_NonCoreFn,
+    Setting_IsExtended,
+    Setting_IsExtendedFn,
+    Setting_IsLegacy,
+    Setting_IsLegacyFn
+} setting_type_t;
+
+typedef struct {
+    uint8_t reboot_required :1,
+            allow_null      :1;
+} setting_flags_t;
+
+typedef struct {
+    setting_group_t parent;
+    setting_group_t id;
+    const char *name;
+} setting_group_detail_t;
+
+typedef struct setting_detail setting_detail_t;
+typedef bool (*setting_is_available_ptr)(const setting_detail_t *setting);
+typedef status_code_t (*setting_set_int_ptr)(setting_id_t id, uint_fast16_t int_value);
+typedef uint32_t (*setting_get_int_ptr)(setting_id_t id);
+
+struct setting_detail {
+    setting_id_t id;
+    setting_group_t group;
+    const char *name;
+    const char *unit;
+    setting_datatype_t datatype;
+    const char *format;
+    const char *min_value;
+    const char *max_value;
+    setting_type_t type;
+    void *value;
+    void *get_value;
+    setting_is_available_ptr is_available;
+    setting_flags_t flags;
+};
+
+typedef struct {
+    setting_id_t id;
+    const char *description;
+} setting_descr_t;
+
+typedef struct setting_details {
+    const uint8_t n_groups;
+    const setting_group_detail_t *groups;
+    const uint16_t n_settings;
+    const setting_detail_t *settings;
+    const uint16_t n_descriptions;
+    const setting_descr_t *descriptions;
+    void (*save)(void);
+    void (*load)(void);
+    void (*restore)(void);
+} setting_details_t;
+
+void settings_register (setting_details_t *details);
+
+// NVS
+
+typedef enum {
+    NVS_TransferResult_Failed = 0,
+    NVS_TransferResult_Busy,
+    NVS_TransferResult_OK
+} nvs_transfer_result_t;
+
+typedef struct {
+    nvs_transfer_result_t (*memcpy_to_nvs)(nvs_address_t dest, uint8_t *source, uint32_t size, bool with_checksum);
+    nvs_transfer_result_t (*memcpy_from_nvs)(uint8_t *dest, nvs_address_t source, uint32_t size, bool with_checksum);
+} nvs_io_t;
+
+// Aux ports
+
+typedef enum {
+    Port_Analog = 0,
+    Port_Digital
+} io_port_type_t;
+
+typedef enum {
+    Port_Input = 0,
+    Port_Output
+} io_port_direction_t;
+
+typedef enum {
+    WaitMode_Immediate = 0,
+    WaitMode_Timeout,
+    WaitMode_Rise,
+    WaitMode_Fall,
+    WaitMode_High,
+    WaitMode_Low
+} wait_mode_t;
+
+typedef enum {
+    IRQ_Mode_None = 0,
+    IRQ_Mode_Rising,
+    IRQ_Mode_Falling,
+    IRQ_Mode_Change
+} pin_irq_mode_t;
+
+typedef void (*ioport_interrupt_callback_ptr)(uint8_t port, bool state);
+
+typedef struct {
+    uint8_t num_digital_in;
+    uint8_t num_digital_out;
+    int32_t (*wait_on_input)(io_port_type_t type, uint8_t port, wait_mode_t wait_mode, float timeout);
+    void (*digital_out)(uint8_t port, bool on);
+    bool (*register_interrupt_handler)(uint8_t port, pin_irq_mode_t irq_mode, ioport_interrupt_callback_ptr interrupt_callback);
+    void (*set_pin_description)(io_port_type_t type, io_port_direction_t dir, uint8_t port, const char *description);
+} io_port_t;
+
+bool ioport_claim (io_port_type_t type, io_port_direction_t dir, uint8_t *port, const char *description);
+bool ioport_can_claim_explicit (void);
+uint8_t ioports_available (io_port_type_t type, io_port_direction_t dir);
+
+// HAL
+
+typedef void (*delay_callback_ptr)(void);
+typedef void (*driver_reset_ptr)(void);
+typedef void (*stream_write_ptr)(const char *s);
+typedef void (*tool_select_ptr)(tool_data_t *tool, bool next);
+typedef status_code_t (*tool_change_ptr)(parser_state_t *gc_state);
+
+typedef struct {
+    stream_write_ptr write;
+} io_stream_t;
+
+typedef struct {
+    void (*set_state)(coolant_state_t state);
+} coolant_ptrs_t;
+
+typedef struct {
+    tool_select_ptr select;
+    tool_change_ptr change;
+} tool_ptrs_t;
+
+typedef struct {
+    uint32_t atc :1;
+} driver_cap_t;
+
+typedef struct {
+    driver_cap_t driver_cap;
+    void (*delay_ms)(uint32_t ms, delay_callback_ptr callback);
+    uint32_t (*get_elapsed_ticks)(void);
+    io_stream_t stream;
+    io_port_t port;
+    coolant_ptrs_t coolant;
+    tool_ptrs_t tool;
+    driver_reset_ptr driver_reset;
+    nvs_io_t nvs;
+} grbl_hal_t;
+
+extern grbl_hal_t hal;
+
+// Core event hooks
+
+typedef enum {
+    Message_None = 0,
+    Message_ReferenceTLOEstablished = 17
+} message_code_t;
+
+typedef union {
+    uint32_t value;
+    struct {
+        uint32_t mpg_mode      :1,
+                 homed         :1,
+                 xmode         :1,
+                 spindle       :1,
+                 coolant       :1,
+                 overrides     :1,
+                 probe         :1,
+                 tool          :1,
+                 wco           :1,
+                 pwm           :1,
+                 tlo_reference :1,
+                 all           :1;
+    };
+} report_tracking_flags_t;
+
+typedef enum {
+    Report_Tool = bit(9),
+    Report_TLOReference = bit(12)
+} report_tracking_t;
+
+typedef enum {
+    ProgramFlow_Running = 0,
+    ProgramFlow_CompletedM2 = 2,
+    ProgramFlow_Paused = 3,
+    ProgramFlow_CompletedM30 = 30
+} program_flow_t;
+
+typedef status_code_t (*sys_command_ptr)(sys_state_t state, char *args);
+
+typedef union {
+    uint8_t flags;
+    struct {
+        uint8_t noargs         :1,
+                allow_blocking :1,
+                help_fn        :1;
+    };
+} sys_command_flags_t;
+
+typedef union {
+    const char *str;
+    const char *(*fn)(const char *command);
+} sys_command_help_t;
+
+typedef struct {
+    const char *command;
+    sys_command_ptr execute;
+    sys_command_flags_t flags;
+    sys_command_help_t help;
+} sys_command_t;
+
+typedef struct sys_commands_str {
+    const uint8_t n_commands;
+    const sys_command_t *commands;
+    struct sys_commands_str *(*on_get_commands)(void);
+} sys_commands_t;
+
+typedef void (*on_report_options_ptr)(bool newopt);
+typedef void (*on_realtime_report_ptr)(stream_write_ptr stream_write, report_tracking_flags_t report);
+typedef void (*on_execute_realtime_ptr)(sys_state_t state);
+typedef void (*on_program_completed_ptr)(program_flow_t program_flow, bool check_mode);
+typedef sys_commands_t *(*on_get_commands_ptr)(void);
+
+typedef struct {
+    void (*feedback_message)(message_code_t message_code);
+} report_t;
+
+typedef struct {
+    uint32_t n_tools;
+    tool_data_t *tool;
+} tool_table_t;
+
+typedef struct {
+    on_report_options_ptr on_report_options;
+    on_realtime_report_ptr on_realtime_report;
+    on_execute_realtime_ptr on_execute_realtime;
+    on_program_completed_ptr on_program_completed;
+    on_get_commands_ptr on_get_commands;
+    report_t report;
+    tool_table_t tool_table;
+} grbl_t;
+
+extern grbl_t grbl;
+
+// Core functions
+
+typedef void (*foreground_task_ptr)(void *data);
+
+void report_warning (void *message);
+void report_info (void *message);
+
+sys_state_t state_get (void);
+void system_convert_array_steps_to_mpos (float *position, int32_t *steps);
+void system_set_exec_state_flag (uint_fast16_t flag);
+void system_add_rt_report (report_tracking_t report);
+
+void plan_data_init (plan_line_data_t *plan_data);
+void *plan_get_current_block (void);
+void sync_position (void);
+
+float gc_get_offset (uint_fast8_t idx);
+bool gc_set_tool_offset (tool_offset_mode_t mode, uint_fast8_t idx, int32_t offset);
+
+void spindle_all_off (void);
+bool spindle_restore (spindle_ptrs_t *spindle, spindle_state_t state, float rpm);
+void coolant_sync (coolant_state_t state);
+
+#endif
@@ -0,0 +1,30 @@
+/*
+  protocol.h - Subset of the grblHAL core API used by the RapidChange plugin, for the host tests
+
+  Part of grblHAL
+
+  Grbl is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Grbl is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Grbl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _PROTOCOL_H_
+#define _PROTOCOL_H_
+
+#include "hal.h"
+
+bool protocol_buffer_synchronize (void);
+bool protocol_execute_realtime (void);
+void protocol_auto_cycle_start (void);
+bool protocol_enqueue_foreground_task (foreground_task_ptr fn, void *data);
+
+#endif
@@ -0,0 +1,858 @@
+/*
+  mock.c - Mocked grblHAL core for the host tests of the RapidChange plugin
+
+  Part of grblHAL
+
+  Grbl is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Grbl is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Grbl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "mock.h"
+#include "grbl/motion_control.h"
+#include "grbl/protocol.h"
+#include "grbl/nvs_buffer.h"
+#include "grbl/nuts_bolts.h"
+
+#include "rapidchange_atc.h"
+
+#define MOCK_NVS_SIZE 4096
+
+parser_state_t gc_state;
+system_t sys;
+settings_t settings;
+grbl_hal_t hal;
+grbl_t grbl;
+mock_t mock;
+
+static uint8_t nvs[MOCK_NVS_SIZE];
+static nvs_address_t nvs_top;
+static uint8_t claimed[2];
+static tool_data_t tool, next_tool;
+static spindle_ptrs_t spindle;
+static spindle_data_t spindle_data;
+
+static ioport_interrupt_callback_ptr beam_irq;
+static uint8_t beam_port;
+static bool beam_tool, beam_state;
+static float ramp_from;
+
+static spindle_data_t *spindle_get_data (spindle_data_request_t request);
+static void beam_update (void);
+
+// Planner and clock
+
+// Planner block of a queued move, speeds in mm/ms and accelerations in mm/ms^2.
+typedef struct {
+    float unit[N_AXIS];
+    float length;
+    float nominal;
+    float accel;
+    float junction;
+} mock_block_t;
+
+static mock_block_t block[MOCK_MAX_MOVES];
+static float last_unit[N_AXIS];
+static float progress, speed;
+
+// Limit of a value per axis along the direction of the move, like the core limits the rate and the acceleration.
+static float axis_limit (float *unit, bool rate)
+{
+    float limit = INFINITY;
+
+    for(uint_fast8_t idx = 0; idx < N_AXIS; idx++) {
+        if(unit[idx] != 0.0f)
+            limit = fminf(limit, (rate ? settings.axis[idx].max_rate : settings.axis[idx].acceleration) / fabsf(unit[idx]));
+    }
+
+    return limit;
+}
+
+// Max speed at the junction with the move queued before from the junction deviation, like the core plans it.
+// A move queued to the idle planner starts from a stop.
+static float junction_speed (mock_block_t *next, bool idle)
+{
+    float cos_theta = 0.0f, vector[N_AXIS], length = 0.0f;
+    uint_fast8_t idx;
+
+    if(idle)
+        return 0.0f;
+
+    for(idx = 0; idx < N_AXIS; idx++) {
+        cos_theta -= last_unit[idx] * next->unit[idx];
+        vector[idx] = next->unit[idx] - last_unit[idx];
+        length += vector[idx] * vector[idx];
+    }
+
+    if(cos_theta > 0.999999f)
+        return 0.0f;
+
+    if(cos_theta < -0.999999f)
+        return INFINITY;
+
+    length = sqrtf(length);
+    for(idx = 0; idx < N_AXIS; idx++)
+        vector[idx] /= length;
+
+    float sin_theta_d2 = sqrtf(0.5f * (1.0f - cos_theta));
+
+    return sqrtf(axis_limit(vector, false) / 3.6e9f * settings.junction_deviation * sin_theta_d2 / (1.0f - sin_theta_d2));
+}
+
+// Record the move and plan its block, the rate is limited by the max rate and the acceleration of the moving axes.
+static mock_move_t *queue_move (mock_move_type_t type, float *target, float feed_rate)
+{
+    uint_fast16_t idx = mock.n_moves < MOCK_MAX_MOVES ? mock.n_moves++ : MOCK_MAX_MOVES - 1;
+    mock_move_t *move = &mock.move[idx];
+    mock_block_t *plan = &block[idx];
+    bool idle = idx == mock.n_done;
+
+    move->type = type;
+    memcpy(move->target.values, target, sizeof(coord_data_t));
+    move->feed_rate = feed_rate;
+    move->start = move->end = 0;
+
+    plan->length = 0.0f;
+    for(uint_fast8_t axis = 0; axis < N_AXIS; axis++) {
+        plan->unit[axis] = target[axis] - mock.position.values[axis];
+        plan->length += plan->unit[axis] * plan->unit[axis];
+    }
+
+    if((plan->length = sqrtf(plan->length)) > 0.0f) {
+        for(uint_fast8_t axis = 0; axis < N_AXIS; axis++)
+            plan->unit[axis] /= plan->length;
+        plan->nominal = fminf(type == Move_Rapid ? INFINITY : feed_rate, axis_limit(plan->unit, true)) / 60000.0f;
+        plan->accel = axis_limit(plan->unit, false) / 3.6e9f;
+        plan->junction = junction_speed(plan, idle);
+        memcpy(last_unit, plan->unit, sizeof(last_unit));
+    } else {
+        // A move of zero length passes at the speed of the junction
+        plan->nominal = plan->junction = INFINITY;
+        plan->accel = 0.0f;
+    }
+
+    if(idx > 0 && !idle)
+        plan->junction = fminf(plan->junction, fminf(plan->nominal, block[idx - 1].nominal));
+
+    mock.travel += plan->length;
+    mock.position = move->target;
+    mock.ramp_pending = false;
+
+    return move;
+}
+
+// Run the queued moves for one ms. The speed ramps up by the acceleration of the move and is limited by
+// the deceleration to a stop at the end of the queued moves, like the core replans the blocks on each move queued.
+static void run_motion (void)
+{
+    float time = 1.0f;
+
+    while(time > 0.0f && mock.n_done < mock.n_moves) {
+        mock_move_t *move = &mock.move[mock.n_done];
+        mock_block_t *plan = &block[mock.n_done];
+        float exit = 0.0f, remaining = plan->length - progress;
+
+        if(move->start == 0 && progress == 0.0f)
+            move->start = mock.clock;
+
+        for(uint_fast16_t idx = mock.n_moves - 1; idx > mock.n_done; idx--)
+            exit = fminf(block[idx].junction, sqrtf(exit * exit + 2.0f * block[idx].accel * block[idx].length));
+
+        float next = fminf(fminf(speed + plan->accel * time, plan->nominal), sqrtf(exit * exit + 2.0f * plan->accel * remaining));
+        float distance = (speed + next) * 0.5f * time;
+
+        if(distance >= remaining) {
+            time -= distance > 0.0f ? time * remaining / distance : 0.0f;
+            speed = fminf(next, exit);
+            progress = 0.0f;
+            move->end = mock.clock;
+            for(uint_fast8_t idx = 0; idx < N_AXIS; idx++)
+                sys.position[idx] = lroundf(move->target.values[idx] * settings.axis[idx].steps_per_mm);
+            mock.n_done++;
+        } else {
+            speed = next;
+            progress += distance;
+            time = 0.0f;
+            for(uint_fast8_t idx = 0; idx < N_AXIS; idx++)
+                sys.position[idx] = lroundf((move->target.values[idx] - plan->unit[idx] * (plan->length - progress)) * settings.axis[idx].steps_per_mm);
+        }
+    }
+
+    if(mock.n_done == mock.n_moves)
+        speed = 0.0f;
+}
+
+// The reset flushes the planner, the machine stops where it is.
+static void mock_reset (void)
+{
+    mock.resets++;
+
+    mock.n_done = mock.n_moves;
+    progress = speed = 0.0f;
+    system_convert_array_steps_to_mpos(mock.position.values, sys.position);
+}
+
+// Advance the clock, the time without motion queued after a spindle change is a spindle ramp wait.
+static void advance (uint32_t ms)
+{
+    while(ms--) {
+        if(mock.n_done == mock.n_moves && mock.ramp_pending) {
+            if(!mock.ramp_counted)
+                mock.ramp_waits++;
+            mock.ramp_counted = true;
+            mock.ramp_wait_time++;
+        }
+
+        run_motion();
+        beam_update();
+        mock.clock++;
+
+        if(mock.abort_at && mock.clock >= mock.abort_at && !sys.abort) {
+            uint16_t writes = mock.n_nvs_writes;
+
+            sys.abort = true;
+            hal.driver_reset();
+            mock.reset_writes += mock.n_nvs_writes - writes;
+        }
+    }
+}
+
+// Like the core a move waits for a free block when the planner is full.
+bool mc_line (float *target, plan_line_data_t *pl_data)
+{
+    while(mock.n_moves - mock.n_done >= MOCK_PLANNER_SIZE) {
+        if(!protocol_execute_realtime())
+            return false;
+    }
+
+    if(ABORTED)
+        return false;
+
+    queue_move(pl_data->condition.rapid_motion ? Move_Rapid : Move_Feed, target, pl_data->feed_rate);
+
+    return true;
+}
+
+// The probe triggers when passing the probe Z of the mock, the motion is completed like the core does.
+gc_probe_t mc_probe_cycle (float *target, plan_line_data_t *pl_data, gc_parser_flags_t parser_flags)
+{
+    if(!protocol_buffer_synchronize())
+        return GCProbe_Abort;
+
+    coord_data_t to;
+    bool found = (mock.position.z >= mock.probe_z && target[Z_AXIS] <= mock.probe_z) ||
+                  (mock.position.z <= mock.probe_z && target[Z_AXIS] >= mock.probe_z);
+
+    memcpy(to.values, target, sizeof(coord_data_t));
+    if(found)
+        to.z = mock.probe_z;
+
+    queue_move(Move_Probe, to.values, pl_data->feed_rate);
+    mock.probes++;
+
+    while(plan_get_current_block()) {
+        if(!protocol_execute_realtime())
+            return GCProbe_Abort;
+    }
+
+    memcpy(sys.probe_position, sys.position, sizeof(sys.position));
+
+    return found ? GCProbe_Found : GCProbe_FailEnd;
+}
+
+void plan_data_init (plan_line_data_t *plan_data)
+{
+    memset(plan_data, 0, sizeof(plan_line_data_t));
+    spindle.get_data = mock.spindle_feedback ? spindle_get_data : NULL;
+    plan_data->spindle.hal = &spindle;
+}
+
+void *plan_get_current_block (void)
+{
+    return mock.n_done < mock.n_moves ? &mock.move[mock.n_done] : NULL;
+}
+
+sys_state_t state_get (void)
+{
+    return mock.n_done < mock.n_moves ? STATE_CYCLE : STATE_IDLE;
+}
+
+void sync_position (void)
+{
+}
+
+bool protocol_buffer_synchronize (void)
+{
+    mock.syncs++;
+
+    while(plan_get_current_block()) {
+        if(!protocol_execute_realtime())
+            return false;
+    }
+
+    return !ABORTED;
+}
+
+// One call is one ms of the mocked clock.
+bool protocol_execute_realtime (void)
+{
+    advance(1);
+    grbl.on_execute_realtime(state_get());
+
+    return !ABORTED;
+}
+
+void protocol_auto_cycle_start (void)
+{
+}
+
+// Foreground tasks are run at once.
+bool protocol_enqueue_foreground_task (foreground_task_ptr fn, void *data)
+{
+    fn(data);
+
+    return true;
+}
+
+static void delay_ms (uint32_t ms, delay_callback_ptr callback)
+{
+    advance(ms);
+}
+
+static uint32_t get_elapsed_ticks (void)
+{
+    return mock.clock;
+}
+
+// Spindle
+
+// The speed ramps from the speed at the last change to the programmed speed in MOCK_SPINDLE_RAMP ms.
+static float spindle_rpm (void)
+{
+    mock_spindle_t *last = mock.n_spindle ? &mock.spindle[mock.n_spindle - 1] : NULL;
+    float rpm = last && last->state.on ? last->rpm : 0.0f;
+
+    if(last && mock.clock - last->time < MOCK_SPINDLE_RAMP)
+        rpm = ramp_from + (rpm - ramp_from) * (float)(mock.clock - last->time) / MOCK_SPINDLE_RAMP;
+
+    return rpm;
+}
+
+static spindle_data_t *spindle_get_data (spindle_data_request_t request)
+{
+    spindle_data.rpm = spindle_rpm();
+    if(mock.seat_z != 0.0f && sys.position[Z_AXIS] <= lroundf(mock.seat_z * settings.axis[Z_AXIS].steps_per_mm))
+        spindle_data.rpm *= 0.5f;
+
+    return &spindle_data;
+}
+
+static void spindle_set_state (spindle_ptrs_t *spindle_ptrs, spindle_state_t state, float rpm)
+{
+    ramp_from = spindle_rpm();
+
+    if(mock.n_spindle < MOCK_MAX_SPINDLE) {
+        mock.spindle[mock.n_spindle].state = state;
+        mock.spindle[mock.n_spindle].rpm = rpm;
+        mock.spindle[mock.n_spindle++].time = mock.clock;
+    }
+    mock.ramp_pending = true;
+    mock.ramp_counted = false;
+}
+
+void spindle_all_off (void)
+{
+}
+
+bool spindle_restore (spindle_ptrs_t *spindle_ptrs, spindle_state_t state, float rpm)
+{
+    return true;
+}
+
+void coolant_sync (coolant_state_t state)
+{
+}
+
+static void coolant_set_state (coolant_state_t state)
+{
+}
+
+// Aux ports, the dust cover feedback is the port next to the tool recognition port.
+// The IR beam is read from the sensor script, or with the interrupt registered sensed at the tool recognition zone 1.
+
+bool ioport_can_claim_explicit (void)
+{
+    return true;
+}
+
+uint8_t ioports_available (io_port_type_t type, io_port_direction_t dir)
+{
+    return dir == Port_Input ? MOCK_IN_PORTS : MOCK_OUT_PORTS;
+}
+
+bool ioport_claim (io_port_type_t type, io_port_direction_t dir, uint8_t *port, const char *description)
+{
+    if(*port >= ioports_available(type, dir) || (claimed[dir] & bit(*port)))
+        return false;
+
+    claimed[dir] |= bit(*port);
+
+    return true;
+}
+
+// The nut of a tool in the spindle breaks the IR beam within MOCK_BEAM_WIDTH of the beam Z.
+static bool beam_broken (void)
+{
+    return beam_tool && fabsf(sys.position[Z_AXIS] / settings.axis[Z_AXIS].steps_per_mm - MOCK_BEAM_Z) <= MOCK_BEAM_WIDTH;
+}
+
+// Raise the interrupt on a change of the IR beam while moving.
+static void beam_update (void)
+{
+    if(beam_irq && beam_broken() != beam_state)
+        beam_irq(beam_port, beam_state = !beam_state);
+}
+
+// With the interrupt registered the tool in the spindle is read from the script, the beam is then sensed along the motion.
+static bool register_interrupt_handler (uint8_t port, pin_irq_mode_t irq_mode, ioport_interrupt_callback_ptr interrupt_callback)
+{
+    if((beam_irq = irq_mode == IRQ_Mode_None ? NULL : interrupt_callback)) {
+        mock.sensor_reads++;
+        beam_port = port;
+        beam_tool = mock.sensor && *mock.sensor ? *mock.sensor++ == '1' : false;
+        beam_state = beam_broken();
+    }
+
+    return true;
+}
+
+static int32_t wait_on_input (io_port_type_t type, uint8_t port, wait_mode_t wait_mode, float timeout)
+{
+    if(port == MOCK_IN_PORTS - 2)
+        return mock.cover_open;
+
+    if(beam_irq)
+        return beam_state;
+
+    mock.sensor_reads++;
+
+    return mock.sensor && *mock.sensor ? *mock.sensor++ == '1' : 0;
+}
+
+static void digital_out (uint8_t port, bool on)
+{
+    mock.cover_open = on;
+    mock.cover_changes++;
+}
+
+// NVS, the checksum is a byte after the data.
+
+static uint8_t checksum (uint8_t *data, uint32_t size)
+{
+    uint8_t sum = 0x5A;
+
+    while(size--)
+        sum += *data++;
+
+    return sum;
+}
+
+static nvs_transfer_result_t memcpy_to_nvs (nvs_address_t dest, uint8_t *source, uint32_t size, bool with_checksum)
+{
+    if(dest + size + 1 > MOCK_NVS_SIZE)
+        return NVS_TransferResult_Failed;
+
+    memcpy(&nvs[dest], source, size);
+    if(with_checksum)
+        nvs[dest + size] = checksum(source, size);
+
+    if(mock.n_nvs_writes < MOCK_MAX_NVS_WRITES) {
+        mock.nvs_write[mock.n_nvs_writes].address = dest;
+        mock.nvs_write[mock.n_nvs_writes].size = size;
+    }
+    mock.n_nvs_writes++;
+
+    return NVS_TransferResult_OK;
+}
+
+static nvs_transfer_result_t memcpy_from_nvs (uint8_t *dest, nvs_address_t source, uint32_t size, bool with_checksum)
+{
+    if(source + size + 1 > MOCK_NVS_SIZE)
+        return NVS_TransferResult_Failed;
+
+    memcpy(dest, &nvs[source], size);
+
+    return !with_checksum || nvs[source + size] == checksum(dest, size) ? NVS_TransferResult_OK : NVS_TransferResult_Failed;
+}
+
+nvs_address_t nvs_alloc (size_t size)
+{
+    nvs_address_t address = nvs_top + 1;
+
+    if(address + size + 1 > MOCK_NVS_SIZE)
+        return 0;
+
+    nvs_top += size + 1;
+    if(mock.n_blocks < MOCK_MAX_BLOCKS)
+        mock.block[mock.n_blocks++] = address;
+
+    return address;
+}
+
+uint8_t *mock_nvs (nvs_address_t address)
+{
+    return &nvs[address];
+}
+
+uint16_t mock_block_writes (uint8_t block)
+{
+    uint16_t writes = 0;
+
+    for(uint_fast16_t idx = 0; idx < mock.n_nvs_writes && idx < MOCK_MAX_NVS_WRITES; idx++) {
+        if(mock.nvs_write[idx].address >= mock.block[block] && (block + 1 >= mock.n_blocks || mock.nvs_write[idx].address < mock.block[block + 1]))
+            writes++;
+    }
+
+    return writes;
+}
+
+// Settings
+
+void settings_register (setting_details_t *details)
+{
+    mock.details = details;
+    details->load();
+}
+
+static const setting_detail_t *setting_find (setting_id_t id)
+{
+    for(uint_fast16_t idx = 0; mock.details && idx < mock.details->n_settings; idx++) {
+        if(mock.details->settings[idx].id == id)
+            return &mock.details->settings[idx];
+    }
+
+    return NULL;
+}
+
+// Set a setting like the core does, the settings are applied by mock_settings_save().
+bool mock_setting (setting_id_t id, float value)
+{
+    const setting_detail_t *setting = setting_find(id);
+
+    if(setting == NULL)
+        return false;
+
+    if(setting->type == Setting_NonCoreFn)
+        return ((setting_set_int_ptr)setting->value)(id, (uint_fast16_t)value) == Status_OK;
+
+    switch(setting->datatype) {
+
+        case Format_Decimal:
+            *(float *)setting->value = value;
+            break;
+
+        case Format_Int16:
+            *(uint16_t *)setting->value = (uint16_t)value;
+            break;
+
+        default:
+            *(uint8_t *)setting->value = (uint8_t)value;
+            break;
+    }
+
+    return true;
+}
+
+float mock_setting_value (setting_id_t id)
+{
+    const setting_detail_t *setting = setting_find(id);
+
+    if(setting == NULL)
+        return NAN;
+
+    if(setting->type == Setting_NonCoreFn)
+        return (float)((setting_get_int_ptr)setting->get_value)(id);
+
+    switch(setting->datatype) {
+
+        case Format_Decimal:
+            return *(float *)setting->value;
+
+        case Format_Int16:
+            return *(uint16_t *)setting->value;
+
+        default:
+            return *(uint8_t *)setting->value;
+    }
+}
+
+void mock_settings_save (void)
+{
+    mock.details->save();
+    mock_poll(1);
+}
+
+// Core reports
+
+void report_warning (void *message)
+{
+    mock.warnings++;
+    mock.last_warning = message;
+}
+
+void report_info (void *message)
+{
+}
+
+static void stream_write (const char *s)
+{
+    size_t length = strlen(s);
+
+    if(mock.output_length + length < MOCK_OUTPUT_SIZE) {
+        memcpy(&mock.output[mock.output_length], s, length + 1);
+        mock.output_length += length;
+    }
+}
+
+static void feedback_message (message_code_t message_code)
+{
+}
+
+void system_set_exec_state_flag (uint_fast16_t flag)
+{
+    if(flag & EXEC_FEED_HOLD)
+        mock.holds++;
+}
+
+void system_add_rt_report (report_tracking_t report)
+{
+}
+
+void system_convert_array_steps_to_mpos (float *position, int32_t *steps)
+{
+    for(uint_fast8_t idx = 0; idx < N_AXIS; idx++)
+        position[idx] = steps[idx] / settings.axis[idx].steps_per_mm;
+}
+
+float gc_get_offset (uint_fast8_t idx)
+{
+    return 0.0f;
+}
+
+bool gc_set_tool_offset (tool_offset_mode_t mode, uint_fast8_t idx, int32_t offset)
+{
+    mock.tlo_mode = mode;
+    mock.tlo = offset;
+
+    return true;
+}
+
+char *uitoa (uint32_t n)
+{
+    static char buf[8][12];
+    static uint_fast8_t idx = 0;
+
+    idx = (idx + 1) & 7;
+    sprintf(buf[idx], "%lu", (unsigned long)n);
+
+    return buf[idx];
+}
+
+char *ftoa (float n, uint8_t decimal_places)
+{
+    static char buf[8][24];
+    static uint_fast8_t idx = 0;
+
+    idx = (idx + 1) & 7;
+    sprintf(buf[idx], "%.*f", decimal_places, n);
+
+    return buf[idx];
+}
+
+static void on_execute_realtime (sys_state_t state)
+{
+}
+
+static void on_realtime_report (stream_write_ptr stream_write, report_tracking_flags_t report)
+{
+}
+
+static void on_report_options (bool newopt)
+{
+}
+
+// Mock API
+
+// Start the plugin on a homed machine with blank NVS and an empty spindle.
+void mock_init (void)
+{
+    memset(&mock, 0, sizeof(mock_t));
+    memset(&sys, 0, sizeof(system_t));
+    memset(&gc_state, 0, sizeof(parser_state_t));
+    memset(&settings, 0, sizeof(settings_t));
+    memset(&hal, 0, sizeof(grbl_hal_t));
+    memset(&grbl, 0, sizeof(grbl_t));
+    memset(nvs, 0xFF, sizeof(nvs));
+    memset(&tool, 0, sizeof(tool_data_t));
+    nvs_top = 0;
+    claimed[Port_Input] = claimed[Port_Output] = 0;
+    progress = speed = ramp_from = 0.0f;
+    beam_irq = NULL;
+
+    for(uint_fast8_t idx = 0; idx < N_AXIS; idx++) {
+        settings.axis[idx].steps_per_mm = 100.0f;
+        settings.axis[idx].max_rate = 5000.0f;
+        settings.axis[idx].acceleration = 500.0f * 3600.0f;
+    }
+    settings.junction_deviation = 0.01f;
+
+    spindle.set_state = spindle_set_state;
+
+    hal.delay_ms = delay_ms;
+    hal.get_elapsed_ticks = get_elapsed_ticks;
+    hal.stream.write = stream_write;
+    hal.port.wait_on_input = wait_on_input;
+    hal.port.register_interrupt_handler = register_interrupt_handler;
+    hal.port.digital_out = digital_out;
+    hal.coolant.set_state = coolant_set_state;
+    hal.driver_reset = mock_reset;
+    hal.nvs.memcpy_to_nvs = memcpy_to_nvs;
+    hal.nvs.memcpy_from_nvs = memcpy_from_nvs;
+
+    grbl.on_execute_realtime = on_execute_realtime;
+    grbl.on_realtime_report = on_realtime_report;
+    grbl.on_report_options = on_report_options;
+    grbl.report.feedback_message = feedback_message;
+
+    sys.homed.mask = X_AXIS_BIT|Y_AXIS_BIT|Z_AXIS_BIT;
+    sys.cold_start = true;
+    gc_state.tool = &tool;
+    mock.probe_z = -30.0f;
+
+    atc_init();
+    hal.tool.select(&tool, false);
+}
+
+// Restart the plugin with the NVS content kept, the ports are claimed again.
+void mock_restart (void)
+{
+    claimed[Port_Input] = claimed[Port_Output] = 0;
+    nvs_top = 0;
+    mock.n_blocks = 0;
+    mock.warnings = 0;
+    mock.last_warning = NULL;
+    grbl.on_execute_realtime = on_execute_realtime;
+    grbl.on_realtime_report = on_realtime_report;
+    grbl.on_report_options = on_report_options;
+    grbl.on_get_commands = NULL;
+    sys.cold_start = true;
+
+    atc_init();
+}
+
+// Settings of the machine the tests run on, a magazine of 6 pockets along X at Y50 with pocket 1 at X100.
+void mock_machine (void)
+{
+    mock_setting(902, 6.0f);
+    mock_setting(904, 100.0f);
+    mock_setting(905, 50.0f);
+    mock_setting(912, -80.0f);
+    mock_setting(913, -40.0f);
+    mock_setting(914, -5.0f);
+    mock_setting(931, 10.0f);
+    mock_setting(932, 10.0f);
+    mock_setting(933, -20.0f);
+    mock_setting(942, -60.0f);
+    mock_setting(943, -50.0f);
+    mock_settings_save();
+}
+
+// Clear the recorded moves and calls, the state of the machine and the moves still queued are kept.
+void mock_clear (void)
+{
+    memmove(mock.move, &mock.move[mock.n_done], (mock.n_moves - mock.n_done) * sizeof(mock_move_t));
+    memmove(block, &block[mock.n_done], (mock.n_moves - mock.n_done) * sizeof(mock_block_t));
+    mock.n_moves -= mock.n_done;
+    mock.n_done = 0;
+    mock.travel = 0.0f;
+    mock.syncs = 0;
+    mock.n_spindle = 0;
+    mock.ramp_waits = 0;
+    mock.ramp_wait_time = 0;
+    mock.ramp_pending = false;
+    mock.probes = 0;
+    mock.sensor_reads = 0;
+    mock.cover_changes = 0;
+    mock.n_nvs_writes = 0;
+    mock.holds = 0;
+    mock.warnings = 0;
+    mock.last_warning = NULL;
+    mock.output_length = 0;
+    *mock.output = '\0';
+}
+
+// Run the foreground loop for the given time.
+void mock_poll (uint32_t ms)
+{
+    while(ms--)
+        protocol_execute_realtime();
+}
+
+// Select and change to the tool like M6 does, the parser takes the new tool on success.
+status_code_t mock_tool_change (tool_id_t tool_id)
+{
+    status_code_t status;
+
+    memset(&next_tool, 0, sizeof(tool_data_t));
+    next_tool.tool_id = tool_id;
+    hal.tool.select(&next_tool, true);
+
+    if((status = hal.tool.change(&gc_state)) == Status_OK) {
+        memcpy(&tool, &next_tool, sizeof(tool_data_t));
+        gc_state.tool = &tool;
+    }
+
+    return status;
+}
+
+// Execute a $ command of the plugin, the output is appended to mock.output.
+status_code_t mock_command (const char *command, const char *args)
+{
+    static char buf[128];
+
+    for(sys_commands_t *commands = grbl.on_get_commands ? grbl.on_get_commands() : NULL; commands; commands = commands->on_get_commands ? commands->on_get_commands() : NULL) {
+        for(uint_fast8_t idx = 0; idx < commands->n_commands; idx++) {
+            if(!strcmp(commands->commands[idx].command, command)) {
+                if(args)
+                    strncpy(buf, args, sizeof(buf) - 1);
+                return commands->commands[idx].execute(STATE_IDLE, args ? buf : NULL);
+            }
+        }
+    }
+
+    return Status_Unhandled;
+}
+
+// Find the first move of the given type to the position on the axis, any position with axis -1.
+const mock_move_t *mock_find_move (mock_move_type_t type, int axis, float position)
+{
+    for(uint_fast16_t idx = 0; idx < mock.n_moves; idx++) {
+        if(mock.move[idx].type == type && (axis < 0 || fabsf(mock.move[idx].target.values[axis] - position) < 0.001f))
+            return &mock.move[idx];
+    }
+
+    return NULL;
+}
@@ -0,0 +1,133 @@
+/*
+  mock.h - Mocked grblHAL core for the host tests of the RapidChange plugin
+
+  Part of grblHAL
+
+  Grbl is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Grbl is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Grbl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _MOCK_H_
+#define _MOCK_H_
+
+#include "grbl/hal.h"
+
+#define MOCK_MAX_MOVES      2048
+#define MOCK_PLANNER_SIZE   35
+#define MOCK_MAX_SPINDLE    64
+#define MOCK_MAX_NVS_WRITES 64
+#define MOCK_MAX_BLOCKS     8
+#define MOCK_OUTPUT_SIZE    8192
+
+// Time (ms) of the spindle to reach the programmed speed.
+#define MOCK_SPINDLE_RAMP   1000
+
+// IR beam of the tool recognition at zone 1 of mock_machine(), broken by the nut within the width.
+#define MOCK_BEAM_Z         -60.0f
+#define MOCK_BEAM_WIDTH     5.0f
+
+// Aux ports claimed by the plugin with the default settings, the last ones available.
+#define MOCK_IN_PORTS       4
+#define MOCK_OUT_PORTS      4
+
+typedef enum {
+    Move_Rapid = 0,
+    Move_Feed,
+    Move_Probe
+} mock_move_type_t;
+
+// Move queued to the mocked planner, times in ms of the mocked clock.
+typedef struct {
+    mock_move_type_t type;
+    coord_data_t target;
+    float feed_rate;
+    uint32_t start;
+    uint32_t end;
+} mock_move_t;
+
+typedef struct {
+    spindle_state_t state;
+    float rpm;
+    uint32_t time;
+} mock_spindle_t;
+
+typedef struct {
+    nvs_address_t address;
+    uint32_t size;
+} mock_nvs_write_t;
+
+typedef struct {
+    // Mocked clock and planner, the queued moves are blended at the junctions like the core plans them
+    uint32_t clock;
+    coord_data_t position;
+    mock_move_t move[MOCK_MAX_MOVES];
+    uint16_t n_moves;
+    uint16_t n_done;
+    float travel;
+    uint16_t syncs;
+    // Reset raised by the mock once the clock reaches the given time
+    uint32_t abort_at;
+    uint8_t resets;
+    uint16_t reset_writes;
+    // Spindle, the speed ramps to the programmed speed, the seat Z drops the reported speed of the engage once reached
+    mock_spindle_t spindle[MOCK_MAX_SPINDLE];
+    uint8_t n_spindle;
+    bool spindle_feedback;
+    float seat_z;
+    uint16_t ramp_waits;
+    uint32_t ramp_wait_time;
+    bool ramp_pending;
+    bool ramp_counted;
+    // Tool setter, the probe triggers at the given Z
+    float probe_z;
+    uint8_t probes;
+    int32_t tlo;
+    tool_offset_mode_t tlo_mode;
+    // Aux ports, the tool recognition sensor reads the script, '1' is triggered. With the interrupt registered
+    // one read tells if the spindle holds a tool
+    const char *sensor;
+    uint8_t sensor_reads;
+    bool cover_open;
+    uint8_t cover_changes;
+    // NVS, the blocks are numbered in order of allocation
+    nvs_address_t block[MOCK_MAX_BLOCKS];
+    uint8_t n_blocks;
+    mock_nvs_write_t nvs_write[MOCK_MAX_NVS_WRITES];
+    uint16_t n_nvs_writes;
+    // Feed holds raised by the plugin, the hold is released at once
+    uint8_t holds;
+    // Output of the stream and the warnings reported
+    char output[MOCK_OUTPUT_SIZE];
+    uint16_t output_length;
+    uint8_t warnings;
+    const char *last_warning;
+    setting_details_t *details;
+} mock_t;
+
+extern mock_t mock;
+
+void mock_init (void);
+void mock_restart (void);
+void mock_machine (void);
+void mock_clear (void);
+bool mock_setting (setting_id_t id, float value);
+float mock_setting_value (setting_id_t id);
+void mock_settings_save (void);
+uint8_t *mock_nvs (nvs_address_t address);
+void mock_poll (uint32_t ms);
+status_code_t mock_tool_change (tool_id_t tool_id);
+status_code_t mock_command (const char *command, const char *args);
+uint16_t mock_block_writes (uint8_t block);
+const mock_move_t *mock_find_move (mock_move_type_t type, int axis, float position);
+
+#endif